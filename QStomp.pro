@@ -25,6 +25,16 @@ TEMPLATE = lib
 CONFIG *= c++14
 DEFINES *= QT_MESSAGELOGCONTEXT
 DEFINES += QSTOMP_LIBRARY
+# qmake CONFIG+=qstomp_no_logging removes all debug logging at compile time
+qstomp_no_logging: DEFINES += QSTOMP_NO_LOGGING
+# CONFIG+=qstomp_usdt adds SDT tracepoints (needs sys/sdt.h), qstomp_no_tracing removes all tracing
+qstomp_usdt: DEFINES += QSTOMP_USDT
+qstomp_no_tracing: DEFINES += QSTOMP_NO_TRACING
+# CONFIG+=qstomp_fuzz instruments the library for tools/fuzz (clang only)
+qstomp_fuzz {
+    QMAKE_CXXFLAGS += -fsanitize=fuzzer-no-link,address,undefined
+    QMAKE_LFLAGS += -fsanitize=address,undefined
+}
 DEPENDPATH += src
 INCLUDEPATH += src
 SOURCES += src/qstomp.cpp
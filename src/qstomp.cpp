@@ -23,18 +23,113 @@
 #include <QtCore/QStringList>
 #include <QtCore/QSet>
 #include <QtCore/QTextCodec>
+#include <QtCore/QThreadStorage>
+#include <QtCore/QTimerEvent>
+#include <QtCore/QDir>
+#include <QtCore/QtEndian>
+#include <QtCore/QtAlgorithms>
+#include <chrono>
 #include <QtNetwork/QTcpSocket>
 #include <QMetaMethod>
 
+Q_LOGGING_CATEGORY(lcStompIo, "qstomp.io", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcStompFrame, "qstomp.frame", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcStompHeartBeat, "qstomp.heartbeat", QtInfoMsg)
+
 static const QList<QByteArray> VALID_COMMANDS = QList<QByteArray>() << "ABORT" << "ACK" << "BEGIN" << "COMMIT" << "CONNECT" << "DISCONNECT"
                                                                     << "CONNECTED" << "MESSAGE" << "SEND" << "SUBSCRIBE" << "UNSUBSCRIBE" << "RECEIPT" << "ERROR";
 
+// Frames parsed outside a client inflate at most as much as a client accepts by default
+static const int MaxInflatedSize = 64*1024*1024;
+
 static const int qStompResponseFrameMetaTypeId = qRegisterMetaType<QStompResponseFrame>();
+static const int qStompResponseFrameVectorMetaTypeId = qRegisterMetaType<QVector<QStompResponseFrame> >();
+
+static const QTextCodec *qStompUtf8Codec()
+{
+    static const QTextCodec *codec = QTextCodec::codecForName("utf-8");
+    return codec;
+}
+
+// UTF-8 is kept as a null codec so the QString conversions can be used directly
+static const QTextCodec *qStompFrameCodec(const QTextCodec *codec)
+{
+    return codec == qStompUtf8Codec() ? nullptr : codec;
+}
+
+// Memory accounting estimate for a received frame: the body plus a flat
+// allowance for the header map and the frame itself
+static qint64 qStompFrameBytes(const QStompResponseFrame &frame)
+{
+    return frame.rawBody().size() + 256;
+}
+
+static const size_t FramePoolBlockSize = qMax(sizeof(QStompResponseFramePrivate), sizeof(QStompRequestFramePrivate));
+static const int FramePoolCapacity = 1024; // blocks kept per thread
+
+QStompFramePool::~QStompFramePool()
+{
+    while(this->m_free){
+        Block *block = this->m_free;
+        this->m_free = block->m_next;
+        ::operator delete(block);
+    }
+}
+
+QStompFramePool *QStompFramePool::local(bool create)
+{
+    static QThreadStorage<QStompFramePool*> pools;
+    if(!pools.hasLocalData()){
+        if(!create)
+            return nullptr;
+        pools.setLocalData(new QStompFramePool);
+    }
+    return pools.localData();
+}
+
+void *QStompFramePool::allocate(size_t size)
+{
+    if(size > FramePoolBlockSize)
+        return ::operator new(size);
+    QStompFramePool *pool = local(true);
+    if(pool->m_free){
+        Block *block = pool->m_free;
+        pool->m_free = block->m_next;
+        pool->m_count--;
+        return block;
+    }
+    return ::operator new(FramePoolBlockSize);
+}
+
+void QStompFramePool::release(void *block, size_t size)
+{
+    QStompFramePool *pool = size <= FramePoolBlockSize ? local(false) : nullptr;
+    if(!pool || pool->m_count >= FramePoolCapacity){
+        ::operator delete(block);
+        return;
+    }
+    Block *free = static_cast<Block*>(block);
+    free->m_next = pool->m_free;
+    pool->m_free = free;
+    pool->m_count++;
+}
+
+void *QStompFramePrivate::operator new(size_t size)
+{
+    return QStompFramePool::allocate(size);
+}
+
+void QStompFramePrivate::operator delete(void *block, size_t size)
+{
+    QStompFramePool::release(block, size);
+}
 
 QStompFrame::QStompFrame(QStompFramePrivate * d) : pd_ptr(d)
 {
     d->m_valid = true;
-    d->m_textCodec = QTextCodec::codecForName("utf-8");
+    d->m_textCodec = nullptr;
+    d->m_bodyDecoded = false;
+    d->m_maxInflatedSize = MaxInflatedSize;
 }
 
 QStompFrame::QStompFrame(const QStompFrame &other, QStompFramePrivate * d) : pd_ptr(d)
@@ -43,6 +138,21 @@ QStompFrame::QStompFrame(const QStompFrame &other, QStompFramePrivate * d) : pd_
     d->m_header = other.pd_ptr->m_header;
     d->m_body = other.pd_ptr->m_body;
     d->m_textCodec = other.pd_ptr->m_textCodec;
+    d->m_decodedBody = other.pd_ptr->m_decodedBody;
+    d->m_bodyDecoded = other.pd_ptr->m_bodyDecoded;
+    d->m_maxInflatedSize = other.pd_ptr->m_maxInflatedSize;
+}
+
+QStompFrame::QStompFrame(QStompFrame &&other, QStompFramePrivate * d) : pd_ptr(d)
+{
+    d->m_valid = other.pd_ptr->m_valid;
+    d->m_header = std::move(other.pd_ptr->m_header);
+    d->m_body = std::move(other.pd_ptr->m_body);
+    d->m_textCodec = other.pd_ptr->m_textCodec;
+    d->m_decodedBody = std::move(other.pd_ptr->m_decodedBody);
+    d->m_bodyDecoded = other.pd_ptr->m_bodyDecoded;
+    d->m_maxInflatedSize = other.pd_ptr->m_maxInflatedSize;
+    other.pd_ptr->m_bodyDecoded = false;
 }
 
 QStompFrame::~QStompFrame()
@@ -57,6 +167,21 @@ QStompFrame & QStompFrame::operator=(const QStompFrame &other)
     d->m_header = other.pd_ptr->m_header;
     d->m_body = other.pd_ptr->m_body;
     d->m_textCodec = other.pd_ptr->m_textCodec;
+    d->m_decodedBody = other.pd_ptr->m_decodedBody;
+    d->m_bodyDecoded = other.pd_ptr->m_bodyDecoded;
+    return *this;
+}
+
+QStompFrame & QStompFrame::operator=(QStompFrame &&other)
+{
+    P_D(QStompFrame);
+    d->m_valid = other.pd_ptr->m_valid;
+    d->m_header = std::move(other.pd_ptr->m_header);
+    d->m_body = std::move(other.pd_ptr->m_body);
+    d->m_textCodec = other.pd_ptr->m_textCodec;
+    d->m_decodedBody = std::move(other.pd_ptr->m_decodedBody);
+    d->m_bodyDecoded = other.pd_ptr->m_bodyDecoded;
+    other.pd_ptr->m_bodyDecoded = false;
     return *this;
 }
 
@@ -72,6 +197,12 @@ void QStompFrame::setHeader(const QVariantMap &values)
     d->m_header = values;
 }
 
+void QStompFrame::setHeader(QVariantMap &&values)
+{
+    P_D(QStompFrame);
+    d->m_header = std::move(values);
+}
+
 QVariantMap QStompFrame::header() const
 {
     const P_D(QStompFrame);
@@ -160,14 +291,16 @@ void QStompFrame::setContentEncoding(const QByteArray &name)
 {
     P_D(QStompFrame);
     this->setHeader(Stomp::HeaderContentEncoding, name);
-    d->m_textCodec = QTextCodec::codecForName(name);
+    d->m_textCodec = qStompFrameCodec(QTextCodec::codecForName(name));
+    d->m_bodyDecoded = false;
 }
 
 void QStompFrame::setContentEncoding(const QTextCodec * codec)
 {
     P_D(QStompFrame);
     this->setHeader(Stomp::HeaderContentEncoding, codec->name());
-    d->m_textCodec = codec;
+    d->m_textCodec = qStompFrameCodec(codec);
+    d->m_bodyDecoded = false;
 }
 
 QByteArray QStompFrame::toByteArray() const
@@ -218,6 +351,7 @@ bool QStompFrame::parse(const QByteArray &frame)
         return false;
 
     d->m_body = frame.mid(headerEnd+2);
+    d->m_bodyDecoded = false;
 
     QList<QByteArray> lines = frame.left(headerEnd).split('\n');
 
@@ -228,10 +362,36 @@ bool QStompFrame::parse(const QByteArray &frame)
         if (!this->parseHeaderLine(lines.at(i), i))
             return false;
     }
-    if (this->hasContentLength())
-        d->m_body.resize(this->contentLength());
+    if (this->hasContentLength()) {
+        if (this->contentLength() < 0)
+            return false;
+        // never pad: a frame parsed from its header alone keeps an empty body
+        if (d->m_body.size() > this->contentLength())
+            d->m_body.resize(this->contentLength());
+    }
     else if (d->m_body.endsWith(Stomp::EndFrame ))
         d->m_body.chop(2);
+    else if (d->m_body.endsWith('\0'))
+        d->m_body.chop(1);
+
+    if (this->headerValue(Stomp::HeaderContentCompression).toByteArray() == Stomp::CompressionZlib) {
+        // qUncompress allocates whatever the size prefix claims
+        if (d->m_body.size() < 4)
+            return false;
+        quint32 inflated = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(d->m_body.constData()));
+        if (d->m_maxInflatedSize > 0 && inflated > quint32(d->m_maxInflatedSize)) {
+            qStompWarning(lcStompFrame) << "Compressed body would inflate to" << inflated << "bytes, over the limit of" << d->m_maxInflatedSize;
+            return false;
+        }
+        // an empty body compresses to a zero size prefix, qUncompress then returns nothing
+        QByteArray body = inflated == 0 ? QByteArray() : qUncompress(d->m_body);
+        if (body.isEmpty() && inflated != 0)
+            return false;
+        d->m_body = body;
+        this->removeHeader(Stomp::HeaderContentCompression);
+        if (this->hasContentLength())
+            this->setContentLength(uint(body.size()));
+    }
 
     return true;
 }
@@ -245,7 +405,11 @@ void QStompFrame::setValid(bool v)
 QString QStompFrame::body() const
 {
     const P_D(QStompFrame);
-    return d->m_textCodec->toUnicode(d->m_body);
+    if (!d->m_bodyDecoded) {
+        d->m_decodedBody = d->m_textCodec ? d->m_textCodec->toUnicode(d->m_body) : QString::fromUtf8(d->m_body);
+        d->m_bodyDecoded = true;
+    }
+    return d->m_decodedBody;
 }
 
 QByteArray QStompFrame::rawBody() const
@@ -257,13 +421,25 @@ QByteArray QStompFrame::rawBody() const
 void QStompFrame::setBody(const QString &body)
 {
     P_D(QStompFrame);
-    d->m_body = d->m_textCodec->fromUnicode(body);
+    d->m_body = d->m_textCodec ? d->m_textCodec->fromUnicode(body) : body.toUtf8();
+    d->m_decodedBody = body;
+    d->m_bodyDecoded = true;
 }
 
 void QStompFrame::setRawBody(const QByteArray &body)
 {
     P_D(QStompFrame);
     d->m_body = body;
+    d->m_bodyDecoded = false;
+    d->m_decodedBody.clear();
+}
+
+void QStompFrame::setRawBody(QByteArray &&body)
+{
+    P_D(QStompFrame);
+    d->m_body = std::move(body);
+    d->m_bodyDecoded = false;
+    d->m_decodedBody.clear();
 }
 
 
@@ -276,6 +452,18 @@ QStompResponseFrame::QStompResponseFrame(const QStompResponseFrame &other) : QSt
 {
     P_D(QStompResponseFrame);
     d->m_type = other.pd_func()->m_type;
+    d->m_selfSent = other.pd_func()->m_selfSent;
+    d->m_readStamp = other.pd_func()->m_readStamp;
+    d->m_frameId = other.pd_func()->m_frameId;
+}
+
+QStompResponseFrame::QStompResponseFrame(QStompResponseFrame &&other) : QStompFrame(std::move(other), new QStompResponseFramePrivate)
+{
+    P_D(QStompResponseFrame);
+    d->m_type = other.pd_func()->m_type;
+    d->m_selfSent = other.pd_func()->m_selfSent;
+    d->m_readStamp = other.pd_func()->m_readStamp;
+    d->m_frameId = other.pd_func()->m_frameId;
 }
 
 QStompResponseFrame::QStompResponseFrame(const QByteArray &frame) : QStompFrame(new QStompResponseFramePrivate)
@@ -283,6 +471,15 @@ QStompResponseFrame::QStompResponseFrame(const QByteArray &frame) : QStompFrame(
     this->setValid(this->parse(frame));
 }
 
+QStompResponseFrame::QStompResponseFrame(const QByteArray &frame, const QStompSelfSentMatcher *matcher, int maxInflatedSize) : QStompFrame(new QStompResponseFramePrivate)
+{
+    P_D(QStompResponseFrame);
+    d->m_matcher = matcher;
+    d->m_maxInflatedSize = maxInflatedSize;
+    this->setValid(this->parse(frame));
+    d->m_matcher = nullptr;
+}
+
 QStompResponseFrame::QStompResponseFrame(Stomp::ResponseCommand type) : QStompFrame(new QStompResponseFramePrivate)
 {
     this->setType(type);
@@ -293,6 +490,20 @@ QStompResponseFrame & QStompResponseFrame::operator=(const QStompResponseFrame &
     QStompFrame::operator=(other);
     P_D(QStompResponseFrame);
     d->m_type = other.pd_func()->m_type;
+    d->m_selfSent = other.pd_func()->m_selfSent;
+    d->m_readStamp = other.pd_func()->m_readStamp;
+    d->m_frameId = other.pd_func()->m_frameId;
+    return *this;
+}
+
+QStompResponseFrame & QStompResponseFrame::operator=(QStompResponseFrame &&other)
+{
+    QStompFrame::operator=(std::move(other));
+    P_D(QStompResponseFrame);
+    d->m_type = other.pd_func()->m_type;
+    d->m_selfSent = other.pd_func()->m_selfSent;
+    d->m_readStamp = other.pd_func()->m_readStamp;
+    d->m_frameId = other.pd_func()->m_frameId;
     return *this;
 }
 
@@ -312,8 +523,15 @@ Stomp::ResponseCommand QStompResponseFrame::type() const
 bool QStompResponseFrame::parseHeaderLine(const QByteArray &line, int number)
 {
     P_D(QStompResponseFrame);
-    if (number != 0)
+    if (number != 0) {
+        const QStompSelfSentMatcher *m = d->m_matcher;
+        // header names are matched case-insensitively, the prefix is lower case
+        if (m && line.size() >= m->m_keyPrefix.size()
+                && qstrnicmp(line.constData(), m->m_keyPrefix.constData(), uint(m->m_keyPrefix.size())) == 0)
+            d->m_selfSent = QByteArray::fromRawData(line.constData() + m->m_keyPrefix.size(),
+                                                    line.size() - m->m_keyPrefix.size()).trimmed() == m->m_session;
         return QStompFrame::parseHeaderLine(line, number);
+    }
     int reponseCommandIdx = Stomp::ResponseCommandList.indexOf(line);
     if(reponseCommandIdx >= 0 && reponseCommandIdx < Stomp::ResponseCommandList.size())
         d->m_type = static_cast<Stomp::ResponseCommand>(reponseCommandIdx);
@@ -416,7 +634,8 @@ void QStompResponseFrame::setMessage(const QString &value)
 
 bool QStompResponseFrame::isSelfSent() const
 {
-    return this->headerValue(Stomp::HeaderResponseSelfSent).toBool();
+    const P_D(QStompResponseFrame);
+    return d->m_selfSent;
 }
 
 
@@ -431,6 +650,12 @@ QStompRequestFrame::QStompRequestFrame(const QStompRequestFrame &other) : QStomp
     d->m_type = other.pd_func()->m_type;
 }
 
+QStompRequestFrame::QStompRequestFrame(QStompRequestFrame &&other) : QStompFrame(std::move(other), new QStompRequestFramePrivate)
+{
+    P_D(QStompRequestFrame);
+    d->m_type = other.pd_func()->m_type;
+}
+
 QStompRequestFrame::QStompRequestFrame(const QByteArray &frame) : QStompFrame(new QStompRequestFramePrivate)
 {
     this->setValid(this->parse(frame));
@@ -449,6 +674,14 @@ QStompRequestFrame & QStompRequestFrame::operator=(const QStompRequestFrame &oth
     return *this;
 }
 
+QStompRequestFrame & QStompRequestFrame::operator=(QStompRequestFrame &&other)
+{
+    QStompFrame::operator=(std::move(other));
+    P_D(QStompRequestFrame);
+    d->m_type = other.pd_func()->m_type;
+    return *this;
+}
+
 void QStompRequestFrame::setType(Stomp::RequestCommand type)
 {
     P_D(QStompRequestFrame);
@@ -491,7 +724,7 @@ QByteArray QStompRequestFrame::toByteArray() const
     if(requestCommandIdx >= 0 && requestCommandIdx < Stomp::RequestCommandList.size()){
         ret = Stomp::RequestCommandList.at(requestCommandIdx).toLatin1()+"\n";
     }else{
-        qWarning() << "The request to send is invalid";
+        qStompWarning(lcStompFrame) << "The request to send is invalid";
         return ret;
     }
 
@@ -593,23 +826,267 @@ void QStompRequestFrame::setSubscriptionId(const QString &value)
 }
 
 
+QStompHistogram::QStompHistogram() : m_count(0), m_sum(0), m_max(0)
+{
+}
+
+bool QStompHistogram::isEmpty() const
+{
+    return this->m_count == 0;
+}
+
+quint64 QStompHistogram::count() const
+{
+    return this->m_count;
+}
+
+qint64 QStompHistogram::max() const
+{
+    return this->m_max;
+}
+
+double QStompHistogram::mean() const
+{
+    return this->m_count ? double(this->m_sum) / this->m_count : 0.0;
+}
+
+qint64 QStompHistogram::percentile(double p) const
+{
+    if (this->m_count == 0)
+        return 0;
+    quint64 rank = quint64(qBound(0.0, p, 1.0) * (this->m_count - 1)) + 1;
+    quint64 seen = 0;
+    for (int i = 0; i < this->m_buckets.size(); ++i) {
+        seen += this->m_buckets.at(i);
+        if (seen >= rank)
+            return i == BucketCount - 1 ? this->m_max : qMin(bucketValue(i), this->m_max);
+    }
+    return this->m_max;
+}
+
+// 16 linear buckets per power of two
+void QStompHistogram::record(qint64 value)
+{
+    if (value < 0)
+        value = 0;
+    if (this->m_buckets.isEmpty())
+        this->m_buckets.resize(BucketCount);
+    this->m_buckets[bucketOf(quint64(value))]++;
+    this->m_count++;
+    this->m_sum += quint64(value);
+    this->m_max = qMax(this->m_max, value);
+}
+
+void QStompHistogram::merge(const QStompHistogram &other)
+{
+    if (other.m_count == 0)
+        return;
+    if (this->m_buckets.isEmpty())
+        this->m_buckets.resize(BucketCount);
+    for (int i = 0; i < other.m_buckets.size(); ++i)
+        this->m_buckets[i] += other.m_buckets.at(i);
+    this->m_count += other.m_count;
+    this->m_sum += other.m_sum;
+    this->m_max = qMax(this->m_max, other.m_max);
+}
+
+int QStompHistogram::bucketOf(quint64 value)
+{
+    if (value < 16)
+        return int(value);
+    if (value >> 36)
+        return BucketCount - 1;
+    int msb = 63 - int(qCountLeadingZeroBits(value));
+    return (msb - 3) * 16 + int((value >> (msb - 4)) & 15);
+}
+
+qint64 QStompHistogram::bucketValue(int bucket)
+{
+    if (bucket < 16)
+        return bucket;
+    int msb = bucket / 16 + 3;
+    // middle of the bucket
+    quint64 low = quint64(16 + bucket % 16) << (msb - 4);
+    return qint64(low + (quint64(1) << (msb - 4)) / 2);
+}
+
+void QStompHistogramData::record(qint64 value)
+{
+    if (value < 0)
+        value = 0;
+    // most clients never see receipts or queued slots, they need no buckets
+    QAtomicInteger<quint64> *buckets = this->m_buckets.loadAcquire();
+    if (!buckets) {
+        buckets = new QAtomicInteger<quint64>[QStompHistogram::BucketCount];
+        if (!this->m_buckets.testAndSetOrdered(nullptr, buckets)) {
+            delete[] buckets;
+            buckets = this->m_buckets.loadAcquire();
+        }
+    }
+    buckets[QStompHistogram::bucketOf(quint64(value))].fetchAndAddRelaxed(1);
+    this->m_count.fetchAndAddRelaxed(1);
+    this->m_sum.fetchAndAddRelaxed(quint64(value));
+    qint64 max = this->m_max.load();
+    while (value > max && !this->m_max.testAndSetRelaxed(max, value, max)) { }
+}
+
+void QStompStatisticsData::snapshot(const QStompHistogramData &data, QStompHistogram *histogram)
+{
+    const QAtomicInteger<quint64> *buckets = data.m_buckets.loadAcquire();
+    if (!buckets)
+        return;
+    histogram->m_buckets.resize(QStompHistogram::BucketCount);
+    quint64 count = 0;
+    for (int i = 0; i < QStompHistogram::BucketCount; ++i) {
+        histogram->m_buckets[i] = buckets[i].load();
+        count += histogram->m_buckets.at(i);
+    }
+    // buckets and totals are read at slightly different times; trust the buckets
+    histogram->m_count = count;
+    histogram->m_sum = data.m_sum.load();
+    histogram->m_max = data.m_max.load();
+}
+
+void QStompStatisticsData::snapshot(QStompClientStatistics *stats) const
+{
+    stats->framesReceived = this->m_framesReceived.load();
+    stats->framesSent = this->m_framesSent.load();
+    stats->messagesReceived = this->m_messagesReceived.load();
+    stats->bytesReceived = this->m_bytesReceived.load();
+    stats->bytesSent = this->m_bytesSent.load();
+    stats->parseErrors = this->m_parseErrors.load();
+    stats->resyncs = this->m_resyncs.load();
+    stats->heartBeatMisses = this->m_heartBeatMisses.load();
+    stats->receiptTimeouts = this->m_receiptTimeouts.load();
+    stats->duplicatesDropped = this->m_duplicates.load();
+    stats->readPauses = this->m_readPauses.load();
+    stats->receiveBufferBytes = this->m_receiveBufferBytes.load();
+    stats->sendQueueBytes = this->m_sendQueueBytes.load();
+    stats->pendingDispatches = this->m_pendingDispatches.load();
+    stats->pendingDispatchBytes = this->m_pendingDispatchBytes.load();
+    stats->heldFrameBytes = this->m_heldFrameBytes.load();
+    stats->pendingReceipts = this->m_pendingReceipts.load();
+    snapshot(this->m_parseTime, &stats->parseTime);
+    snapshot(this->m_dispatchLatency, &stats->dispatchLatency);
+    snapshot(this->m_receiptRoundTrip, &stats->receiptRoundTrip);
+}
+
+void QStompStatisticsData::trace(Stomp::TracePoint point, quint64 frameId, qint64 bytes) const
+{
+    QStompTraceEvent event;
+    event.point = point;
+    event.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    event.frameId = frameId;
+    event.bytes = bytes;
+    this->m_traceHandler(event);
+}
+
+void QStompStatisticsData::dispatchFinished(qint64 bytes)
+{
+    this->m_pendingDispatches.deref();
+    this->m_pendingDispatchBytes.fetchAndAddRelaxed(-bytes);
+    if(Q_UNLIKELY(this->m_readPaused.loadAcquire()))
+        this->requestMemoryCheck();
+}
+
+void QStompStatisticsData::requestMemoryCheck()
+{
+    if(!this->m_memoryCheckQueued.testAndSetAcquire(0, 1))
+        return;
+    QMutexLocker locker(&this->m_clientLock);
+    if(this->m_client)
+        QMetaObject::invokeMethod(this->m_client, "_q_checkMemory", Qt::QueuedConnection);
+}
+
+QStompClientStatistics::QStompClientStatistics() :
+    framesReceived(0), framesSent(0), messagesReceived(0), bytesReceived(0), bytesSent(0),
+    parseErrors(0), resyncs(0), heartBeatMisses(0), receiptTimeouts(0), duplicatesDropped(0),
+    readPauses(0), receiveBufferBytes(0), sendQueueBytes(0), pendingDispatches(0), pendingDispatchBytes(0),
+    heldFrameBytes(0), pendingReceipts(0)
+{
+}
+
+qint64 QStompClientStatistics::memoryInUse() const
+{
+    return receiveBufferBytes + pendingDispatchBytes + heldFrameBytes;
+}
+
+QByteArray QStompClientStatistics::toPrometheus(const QString &prefix, const QString &labels) const
+{
+    QByteArray out;
+    QByteArray p = prefix.toLatin1() + '_';
+    QByteArray l = labels.isEmpty() ? QByteArray() : '{' + labels.toUtf8() + '}';
+    auto metric = [&](const char *name, const char *type, const char *help, double value) {
+        out += "# HELP " + p + name + ' ' + help + '\n';
+        out += "# TYPE " + p + name + ' ' + type + '\n';
+        out += p + name + l + ' ' + QByteArray::number(value, 'g', 17) + '\n';
+    };
+    auto summary = [&](const char *name, const char *help, const QStompHistogram &h) {
+        out += "# HELP " + p + name + ' ' + help + '\n';
+        out += "# TYPE " + p + name + " summary\n";
+        for (double q : {0.5, 0.9, 0.99, 0.999}) {
+            QByteArray quantile = "quantile=\"" + QByteArray::number(q) + '"';
+            out += p + name + '{' + (labels.isEmpty() ? quantile : labels.toUtf8() + ',' + quantile) + "} "
+                    + QByteArray::number(h.percentile(q) / 1e9, 'g', 9) + '\n';
+        }
+        out += p + name + "_sum" + l + ' ' + QByteArray::number(h.mean() * h.count() / 1e9, 'g', 17) + '\n';
+        out += p + name + "_count" + l + ' ' + QByteArray::number(h.count()) + '\n';
+    };
+
+    metric("frames_received_total", "counter", "Frames decoded from the socket.", framesReceived);
+    metric("frames_sent_total", "counter", "Frames written to the socket.", framesSent);
+    metric("messages_received_total", "counter", "MESSAGE frames received.", messagesReceived);
+    metric("received_bytes_total", "counter", "Bytes read from the socket.", bytesReceived);
+    metric("sent_bytes_total", "counter", "Bytes written to the socket.", bytesSent);
+    metric("parse_errors_total", "counter", "Frames that failed to parse.", parseErrors);
+    metric("resyncs_total", "counter", "Times the receive buffer had to be resynchronized.", resyncs);
+    metric("heartbeat_misses_total", "counter", "Connections dropped for missing heart-beats.", heartBeatMisses);
+    metric("receipt_timeouts_total", "counter", "Receipts that did not arrive in time.", receiptTimeouts);
+    metric("duplicates_dropped_total", "counter", "Redelivered messages suppressed.", duplicatesDropped);
+    metric("read_pauses_total", "counter", "Times reading paused for the memory limit.", readPauses);
+    metric("receive_buffer_bytes", "gauge", "Undecoded bytes held after the last read.", receiveBufferBytes);
+    metric("send_queue_bytes", "gauge", "Bytes written but not yet sent.", sendQueueBytes);
+    metric("pending_dispatches", "gauge", "Slot calls queued but not yet started or finished.", pendingDispatches);
+    metric("pending_dispatch_bytes", "gauge", "Frame bytes held by queued slot calls.", pendingDispatchBytes);
+    metric("held_frame_bytes", "gauge", "Frame bytes waiting in batches and flow control backlogs.", heldFrameBytes);
+    metric("pending_receipts", "gauge", "Frames waiting for their receipt.", pendingReceipts);
+    summary("parse_seconds", "Time to parse one frame.", parseTime);
+    summary("dispatch_latency_seconds", "Time from socket read to slot entry.", dispatchLatency);
+    summary("receipt_round_trip_seconds", "Time from send to receipt.", receiptRoundTrip);
+    return out;
+}
+
+
 QStompClient::QStompClient(QObject *parent) : QObject(parent), pd_ptr(new QStompClientPrivate(this))
 {
     P_D(QStompClient);
     d->m_socket = nullptr;
-    d->m_textCodec = QTextCodec::codecForName("utf-8");
+    d->m_textCodec = qStompUtf8Codec();
     d->m_connectionFrame.setHeader(Stomp::HeaderConnectAcceptVersion, Stomp::ProtocolList.join(','));
     d->m_connectionFrame.setHeader(Stomp::HeaderConnectHost, "/");
+    d->m_pingTimer.setSingleShot(true);
+    d->m_pongTimer.setSingleShot(true);
     connect(&d->m_pingTimer, SIGNAL(timeout()), this, SLOT(_q_sendPing()));
     connect(&d->m_pongTimer, SIGNAL(timeout()), this, SLOT(_q_checkPong()));
+    d->m_batchTimer.setSingleShot(true);
+    connect(&d->m_batchTimer, SIGNAL(timeout()), this, SLOT(_q_flushBatches()));
+    d->m_ackTimer.setSingleShot(true);
+    connect(&d->m_ackTimer, SIGNAL(timeout()), this, SLOT(_q_flushAcks()));
+    d->m_receiptTimer.setSingleShot(true);
+    connect(&d->m_receiptTimer, SIGNAL(timeout()), this, SLOT(_q_checkReceipts()));
+    d->m_stats->m_client = this;
 }
 
 QStompClient::~QStompClient()
 {
-    qDebug();
-    QStompSubscription dummy(nullptr, "*");
-    unregisterSubscription(dummy);
+    P_D(QStompClient);
+    qStompDebug(lcStompIo);
+    d->removeSubscriptions(nullptr, "*");
     logout();
+    {
+        QMutexLocker locker(&d->m_stats->m_clientLock);
+        d->m_stats->m_client = nullptr;
+    }
     delete this->pd_ptr;
 }
 
@@ -624,6 +1101,7 @@ void QStompClient::connectToHost(const QString &hostname, quint16 port)
     connect(d->m_socket, SIGNAL(stateChanged(QAbstractSocket::SocketState)), this, SIGNAL(socketStateChanged(QAbstractSocket::SocketState)));
     connect(d->m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SIGNAL(socketError(QAbstractSocket::SocketError)));
     connect(d->m_socket, SIGNAL(readyRead()), this, SLOT(_q_socketReadyRead()));
+    connect(d->m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(_q_socketBytesWritten()));
     d->m_socket->connectToHost(hostname, port);
 }
 
@@ -638,6 +1116,7 @@ void QStompClient::setSocket(QTcpSocket *socket)
     connect(d->m_socket, SIGNAL(stateChanged(QAbstractSocket::SocketState)), this, SLOT(on_socketStateChanged(QAbstractSocket::SocketState)));
     connect(d->m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(on_socketError(QAbstractSocket::SocketError)));
     connect(d->m_socket, SIGNAL(readyRead()), this, SLOT(on_socketReadyRead()));
+    connect(d->m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(_q_socketBytesWritten()));
 }
 
 QTcpSocket * QStompClient::socket() const
@@ -649,20 +1128,76 @@ QTcpSocket * QStompClient::socket() const
 void QStompClient::sendFrame(const QStompRequestFrame &frame)
 {
     if(frame.type() == Stomp::RequestSubscribe || frame.type() == Stomp::RequestUnsubscribe){
-        qCritical() << "Please use registerSubcription and unregisterSubcription";
+        qStompCritical(lcStompFrame) << "Please use registerSubcription and unregisterSubcription";
         return;
     }
     P_D(QStompClient);
-    QStompRequestFrame msg = frame;
-    if(d->m_selfSendFeature){
-        msg.setHeader(d->m_selfSendKey, getConnectedStompSession());
+    QByteArray serialized = d->serialize(frame);
+    // queued behind the outbox while it is replayed, to keep the send order
+    if(d->m_outbox && (d->m_connectedHeaders.isEmpty() || !d->m_outbox->isEmpty() || !d->m_outboxOverflow.isEmpty()) &&
+            frame.type() == Stomp::RequestSend && !frame.hasTransactionId()){
+        bool connected = !d->m_connectedHeaders.isEmpty();
+        if(d->spillOutboxOverflow() && d->m_outbox->append(serialized)){
+            if(connected)
+                d->replayOutbox();
+        }else if(connected){
+            // the replay makes room, the frame waits for it instead of being lost
+            d->m_outboxOverflow.enqueue(serialized);
+            d->replayOutbox();
+        }else{
+            qStompWarning(lcStompIo) << "Outbox full, dropping frame of" << serialized.size() << "bytes";
+        }
+        return;
     }
-    QByteArray serialized = msg.toByteArray().append(Stomp::EndFrame);
-    qDebug() << "Send" << Stomp::RequestCommandList.at(msg.type())
+    qStompDebug(lcStompFrame) << "Send" << Stomp::RequestCommandList.at(frame.type())
              << "of" << serialized.size() << "bytes";
     d->send(serialized);
 }
 
+void QStompClient::sendFrame(QStompRequestFrame &&frame)
+{
+    P_D(QStompClient);
+    if(d->compressible(frame))
+        d->compress(frame);
+    this->sendFrame(static_cast<const QStompRequestFrame &>(frame));
+}
+
+QFuture<QStompResponseFrame> QStompClient::sendFrameWithReceipt(const QStompRequestFrame &frame, int timeout)
+{
+    return this->sendFrameWithReceipt(QStompRequestFrame(frame), timeout);
+}
+
+QFuture<QStompResponseFrame> QStompClient::sendFrameWithReceipt(QStompRequestFrame &&frame, int timeout)
+{
+    P_D(QStompClient);
+    QFutureInterface<QStompResponseFrame> promise;
+    promise.reportStarted();
+    if(frame.type() == Stomp::RequestSubscribe || frame.type() == Stomp::RequestUnsubscribe){
+        qStompCritical(lcStompFrame) << "Please use registerSubcription and unregisterSubcription";
+        promise.reportCanceled();
+        promise.reportFinished();
+        return promise.future();
+    }
+
+    QString receiptId = QString("receipt-%1").arg(++d->m_receiptCounter);
+    frame.setReceiptId(receiptId);
+    if(d->compressible(frame))
+        d->compress(frame);
+
+    QStompPendingReceipt &pending = d->m_receipts[receiptId];
+    pending.m_promise = promise;
+    pending.m_timeout = timeout < 0 ? d->m_receiptTimeout : timeout;
+
+    d->m_stats->m_pendingReceipts.store(d->m_receipts.size());
+
+    QByteArray serialized = d->serialize(frame);
+    if(d->m_maxPendingReceipts > 0 && d->m_receiptsInFlight >= d->m_maxPendingReceipts)
+        d->m_receiptBacklog.enqueue(qMakePair(receiptId, serialized));
+    else
+        d->writeReceiptFrame(receiptId, serialized);
+    return promise.future();
+}
+
 void QStompClient::setLogin(const QString &user, const QString &password)
 {
     P_D(QStompClient);
@@ -683,6 +1218,7 @@ void QStompClient::setSelfSentFeature(bool b, const QString &headerKey)
     P_D(QStompClient);
     d->m_selfSendFeature = b;
     d->m_selfSendKey = headerKey;
+    d->updateSelfSent();
 }
 
 void QStompClient::setVirtualHost(const QString &host) {
@@ -693,155 +1229,361 @@ void QStompClient::setVirtualHost(const QString &host) {
         d->m_connectionFrame.setHeader(Stomp::HeaderConnectHost, host);
 }
 
-void QStompClient::setHeartBeat(const int &outgoing, const int &incoming)
+void QStompClient::setSharedHeartBeatTimer(bool enable)
 {
     P_D(QStompClient);
-    if(incoming == 0 && outgoing == 0)
-        d->m_connectionFrame.removeHeader(Stomp::HeaderConnectHeartBeat);
-    else
-        d->m_connectionFrame.setHeader(Stomp::HeaderConnectHeartBeat, QString("%1,%2").arg(outgoing).arg(incoming));
+    d->m_sharedHeartBeatTimer = enable;
 }
 
-QStompSubscription QStompClient::createSubscription(QObject *subcriber, const char *subcriberSlot, const QString &destination, const QString& ack, const QVariantMap &headers) const
+bool QStompClient::sharedHeartBeatTimer() const
 {
-    return QStompSubscription(subcriber, subcriberSlot, destination, ack, headers);
+    const P_D(QStompClient);
+    return d->m_sharedHeartBeatTimer;
 }
 
-void QStompClient::registerSubscription(QStompSubscription & sub)
+bool QStompClient::setOutbox(const QString &directory, qint64 maxBytes)
 {
     P_D(QStompClient);
-    if(!sub.isValid())
-        return;
-
-    if(!containsSubcription(sub)){
-        connect(sub.d->m_subcriber.data(), &QObject::destroyed,
-                this, &QStompClient::on_subcriberDestroyed, Qt::UniqueConnection);
+    d->m_outboxRecordEnds.clear();
+    delete d->m_outbox;
+    d->m_outbox = nullptr;
+    if(directory.isEmpty()){
+        // nothing to queue behind any more
+        while(!d->m_outboxOverflow.isEmpty())
+            d->send(d->m_outboxOverflow.dequeue());
+        return true;
+    }
 
-        d->m_subscriptions << sub;
-        doSubcription(sub);
-    }else{
-        qWarning() << "Subscription for topic" << sub.d->m_subcribRequestFrame.destination() << "already exist with the same subscriber";
+    d->m_outbox = new QStompOutbox(directory, maxBytes);
+    if(!d->m_outbox->open()){
+        qStompWarning(lcStompIo) << "Unable to open outbox in" << directory;
+        delete d->m_outbox;
+        d->m_outbox = nullptr;
+        return false;
     }
+    if(isConnected())
+        d->replayOutbox();
+    return true;
 }
 
-void QStompClient::unregisterSubscription(QStompSubscription & sub)
+void QStompClient::setDuplicateSuppression(int capacity, const QString &headerKey)
 {
     P_D(QStompClient);
-
-    // TODO disconnect &QObject::destroyed if no more subcription with sub.m_subcriber
-    int destinationSubcribed = 0; //(by the subscriber)
-    int subcriptionRemoved = 0;
-
-    // remove all subscription where :
-    //        elemSub.m_subcriber.isNULL || elemSub.m_subcriber==sub.m_subcriber
-    //  OR    sub.destination=="*" || elemSub.destination==sub.destination
-    for(int i = d->m_subscriptions.size()-1; i>=0; --i){
-        QStompSubscription elemSub = d->m_subscriptions[i];
-        if(elemSub.d->m_subcriber==sub.d->m_subcriber && !sub.d->m_subcriber.isNull())
-            destinationSubcribed++;
-        if(elemSub.d->m_subcriber.isNull() || elemSub.d->m_subcriber==sub.d->m_subcriber ||
-                sub.d->m_subcribRequestFrame.destination()=="*" || sub.d->m_subcribRequestFrame.destination()==elemSub.d->m_subcribRequestFrame.destination()){
-            doUnSubcription(elemSub);
-            d->m_subscriptions.takeAt(i);
-            subcriptionRemoved++;
-        }
-    }
-    if(!sub.d->m_subcriber.isNull() && destinationSubcribed!=0 && destinationSubcribed==subcriptionRemoved){
-        disconnect(sub.d->m_subcriber, &QObject::destroyed,
-                   this, &QStompClient::on_subcriberDestroyed);
-    }
+    delete d->m_dedup;
+    d->m_dedup = capacity > 0 ? new QStompDedupCache(capacity) : nullptr;
+    d->m_dedupKey = headerKey.toLower();
+    d->m_dedupPending.clear();
+    d->m_dedupOrder.clear();
 }
 
-void QStompClient::unregisterSubscription(QObject *subcriber, const QString &destination) {
-    QStompSubscription dummy(subcriber, destination);
-    unregisterSubscription(dummy);
+int QStompClient::duplicateSuppressionCapacity() const
+{
+    const P_D(QStompClient);
+    return d->m_dedup ? d->m_dedup->capacity() : 0;
 }
 
-void QStompClient::logout()
+qint64 QStompClient::duplicatesDropped() const
 {
-    qDebug();
-    doUnSubcriptions();
-    this->sendFrame(QStompRequestFrame(Stomp::RequestDisconnect));
+    const P_D(QStompClient);
+    return qint64(d->m_stats->m_duplicates.load());
 }
 
-void QStompClient::send(const QString &destination, const QString &body, const QString &transactionId, const QVariantMap &headers)
+qint64 QStompClient::duplicateSuppressionMemory() const
 {
-    P_D(QStompClient);
-    QStompRequestFrame frame(Stomp::RequestSend);
-    frame.setHeader(headers);
-    frame.setContentEncoding(d->m_textCodec);
-    frame.setDestination(destination);
-    frame.setBody(body);
-    if (!transactionId.isNull())
-        frame.setTransactionId(transactionId);
-    this->sendFrame(frame);
+    const P_D(QStompClient);
+    return d->m_dedup ? d->m_dedup->memoryUsage() : 0;
 }
 
-void QStompClient::commit(const QString &transactionId, const QVariantMap &headers)
+double QStompClient::duplicateFalsePositiveRate() const
 {
-    QStompRequestFrame frame(Stomp::RequestCommit);
-    frame.setHeader(headers);
-    frame.setTransactionId(transactionId);
-    this->sendFrame(frame);
+    const P_D(QStompClient);
+    return d->m_dedup ? d->m_dedup->falsePositiveRate() : 0;
 }
 
-void QStompClient::begin(const QString &transactionId, const QVariantMap &headers)
+void QStompClient::setBodyCompression(bool enable, int threshold, int level)
 {
-    QStompRequestFrame frame(Stomp::RequestBegin);
-    frame.setHeader(headers);
-    frame.setTransactionId(transactionId);
-    this->sendFrame(frame);
+    P_D(QStompClient);
+    d->m_compression = enable;
+    d->m_compressionThreshold = qMax(0, threshold);
+    d->m_compressionLevel = level;
 }
 
-void QStompClient::abort(const QString &transactionId, const QVariantMap &headers)
+bool QStompClient::bodyCompression() const
 {
-    QStompRequestFrame frame(Stomp::RequestAbort);
-    frame.setHeader(headers);
-    frame.setTransactionId(transactionId);
-    this->sendFrame(frame);
+    const P_D(QStompClient);
+    return d->m_compression;
 }
 
-void QStompClient::ack(const QString &messageId, const QString &transactionId, const QVariantMap &headers)
+int QStompClient::bodyCompressionThreshold() const
 {
-    QStompRequestFrame frame(Stomp::RequestAck);
-    frame.setHeader(headers);
-    frame.setMessageId(messageId);
-    if (!transactionId.isNull())
-        frame.setTransactionId(transactionId);
-    this->sendFrame(frame);
+    const P_D(QStompClient);
+    return d->m_compressionThreshold;
 }
 
-void QStompClient::nack(const QString &messageId, const QString &transactionId, const QVariantMap &headers)
+void QStompClient::setStreamingChunkSize(int bytes)
 {
-    QStompRequestFrame frame(Stomp::RequestNack);
-    frame.setHeader(headers);
-    frame.setMessageId(messageId);
-    if (!transactionId.isNull())
-        frame.setTransactionId(transactionId);
-    this->sendFrame(frame);
+    P_D(QStompClient);
+    d->m_streamChunkSize = qMax(1024, bytes);
 }
 
-bool QStompClient::isConnected() const
+int QStompClient::streamingChunkSize() const
 {
     const P_D(QStompClient);
-    return !d->m_connectedHeaders.isEmpty();
+    return d->m_streamChunkSize;
 }
 
-QString QStompClient::getConnectedStompVersion() const
+void QStompClient::setMaxFrameSize(int bytes)
 {
-    const P_D(QStompClient);
-    return d->m_connectedHeaders.value(Stomp::HeaderConnectedVersion).toString();
+    P_D(QStompClient);
+    d->m_maxFrameSize = qMax(0, bytes);
 }
 
-QString QStompClient::getConnectedStompServeur() const
+int QStompClient::maxFrameSize() const
 {
     const P_D(QStompClient);
-    return d->m_connectedHeaders.value(Stomp::HeaderConnectedServer).toString();
+    return d->m_maxFrameSize;
 }
 
-QString QStompClient::getConnectedStompSession() const
+void QStompClient::setMemoryLimit(qint64 bytes)
 {
-    const P_D(QStompClient);
+    P_D(QStompClient);
+    d->m_memoryLimit = qMax<qint64>(0, bytes);
+    if(d->m_readPaused)
+        d->_q_checkMemory();
+}
+
+qint64 QStompClient::memoryLimit() const
+{
+    const P_D(QStompClient);
+    return d->m_memoryLimit;
+}
+
+bool QStompClient::isReadingPaused() const
+{
+    const P_D(QStompClient);
+    return d->m_readPaused;
+}
+
+QStompClientStatistics QStompClient::statistics() const
+{
+    const P_D(QStompClient);
+    QStompClientStatistics stats;
+    d->m_stats->snapshot(&stats);
+    return stats;
+}
+
+void QStompClient::setTraceHandler(const TraceHandler &handler)
+{
+    P_D(QStompClient);
+    d->m_stats->m_traceHandler = handler;
+}
+
+bool QStompClient::isTracing() const
+{
+    const P_D(QStompClient);
+    return bool(d->m_stats->m_traceHandler);
+}
+
+bool QStompClient::setCaptureFile(const QString &fileName)
+{
+    P_D(QStompClient);
+    delete d->m_capture;
+    d->m_capture = nullptr;
+    if(fileName.isEmpty())
+        return true;
+
+    QFile *file = new QFile(fileName);
+    if(!file->open(QIODevice::WriteOnly | QIODevice::Truncate) || file->write(Stomp::CaptureMagic) != Stomp::CaptureMagic.size()){
+        qStompWarning(lcStompIo) << "Unable to open capture file" << fileName << file->errorString();
+        delete file;
+        return false;
+    }
+    d->m_capture = file;
+    d->m_captureClock.start();
+    return true;
+}
+
+QString QStompClient::captureFile() const
+{
+    const P_D(QStompClient);
+    return d->m_capture ? d->m_capture->fileName() : QString();
+}
+
+void QStompClient::injectReceivedData(const QByteArray &data)
+{
+    P_D(QStompClient);
+    if(data.isEmpty())
+        return;
+    d->processIncoming(data);
+    d->finishReadCycle();
+}
+
+QString QStompClient::outboxDirectory() const
+{
+    const P_D(QStompClient);
+    return d->m_outbox ? d->m_outbox->directory() : QString();
+}
+
+qint64 QStompClient::outboxSize() const
+{
+    const P_D(QStompClient);
+    return d->m_outbox ? d->m_outbox->size() : 0;
+}
+
+void QStompClient::setHeartBeat(const int &outgoing, const int &incoming)
+{
+    P_D(QStompClient);
+    if(incoming == 0 && outgoing == 0)
+        d->m_connectionFrame.removeHeader(Stomp::HeaderConnectHeartBeat);
+    else
+        d->m_connectionFrame.setHeader(Stomp::HeaderConnectHeartBeat, QString("%1,%2").arg(outgoing).arg(incoming));
+}
+
+QStompSubscription QStompClient::createSubscription(QObject *subcriber, const char *subcriberSlot, const QString &destination, const QString& ack, const QVariantMap &headers) const
+{
+    return QStompSubscription(subcriber, subcriberSlot, destination, ack, headers);
+}
+
+void QStompClient::registerSubscription(QStompSubscription & sub)
+{
+    P_D(QStompClient);
+    if(!sub.isValid())
+        return;
+
+    if(!containsSubcription(sub)){
+        sub.d->m_stats = d->m_stats;
+        connect(sub.d->m_subcriber.data(), &QObject::destroyed,
+                this, &QStompClient::on_subcriberDestroyed, Qt::UniqueConnection);
+
+        d->m_subscriptionsBySubscriber[sub.d->m_subcriber.data()] << sub;
+        doSubcription(sub);
+    }else{
+        qStompWarning(lcStompFrame) << "Subscription for topic" << sub.d->m_subcribRequestFrame.destination() << "already exist with the same subscriber";
+    }
+}
+
+void QStompClient::unregisterSubscription(QStompSubscription & sub)
+{
+    P_D(QStompClient);
+    d->removeSubscriptions(sub.d->m_subcriber.data(), sub.d->m_subcribRequestFrame.destination());
+}
+
+void QStompClient::unregisterSubscription(QObject *subcriber, const QString &destination) {
+    P_D(QStompClient);
+    d->removeSubscriptions(subcriber, destination);
+}
+
+void QStompClient::logout()
+{
+    P_D(QStompClient);
+    qStompDebug(lcStompIo);
+    d->writeAcks();
+    doUnSubcriptions();
+    this->sendFrame(QStompRequestFrame(Stomp::RequestDisconnect));
+}
+
+void QStompClient::send(const QString &destination, const QString &body, const QString &transactionId, const QVariantMap &headers)
+{
+    P_D(QStompClient);
+    this->sendFrame(d->sendRequest(destination, body, transactionId, headers));
+}
+
+void QStompClient::send(const QString &destination, const QString &body, const QString &transactionId, QVariantMap &&headers)
+{
+    P_D(QStompClient);
+    this->sendFrame(d->sendRequest(destination, body, transactionId, std::move(headers)));
+}
+
+QFuture<QStompResponseFrame> QStompClient::sendWithReceipt(const QString &destination, const QString &body, const QString &transactionId, const QVariantMap &headers, int timeout)
+{
+    P_D(QStompClient);
+    return this->sendFrameWithReceipt(d->sendRequest(destination, body, transactionId, headers), timeout);
+}
+
+void QStompClient::commit(const QString &transactionId, const QVariantMap &headers)
+{
+    QStompRequestFrame frame(Stomp::RequestCommit);
+    frame.setHeader(headers);
+    frame.setTransactionId(transactionId);
+    this->sendFrame(std::move(frame));
+}
+
+void QStompClient::begin(const QString &transactionId, const QVariantMap &headers)
+{
+    QStompRequestFrame frame(Stomp::RequestBegin);
+    frame.setHeader(headers);
+    frame.setTransactionId(transactionId);
+    this->sendFrame(std::move(frame));
+}
+
+void QStompClient::abort(const QString &transactionId, const QVariantMap &headers)
+{
+    QStompRequestFrame frame(Stomp::RequestAbort);
+    frame.setHeader(headers);
+    frame.setTransactionId(transactionId);
+    this->sendFrame(std::move(frame));
+}
+
+void QStompClient::ack(const QString &messageId, const QString &transactionId, const QVariantMap &headers)
+{
+    P_D(QStompClient);
+    d->dedupAcked(messageId);
+    QExplicitlySharedDataPointer<QStompSubScriptionData> owner = d->acknowledged(messageId);
+    if(owner && owner->m_ackWindow > 0 && transactionId.isNull() && headers.isEmpty()){
+        d->queueAck(owner, messageId);
+        return;
+    }
+    // keep acks ordered behind the ones still waiting for their window
+    d->writeAcks();
+    QStompRequestFrame frame(Stomp::RequestAck);
+    frame.setHeader(headers);
+    frame.setMessageId(messageId);
+    if (!transactionId.isNull())
+        frame.setTransactionId(transactionId);
+    this->sendFrame(std::move(frame));
+}
+
+void QStompClient::nack(const QString &messageId, const QString &transactionId, const QVariantMap &headers)
+{
+    P_D(QStompClient);
+    d->dedupNacked(messageId);
+    d->acknowledged(messageId);
+    d->writeAcks();
+    QStompRequestFrame frame(Stomp::RequestNack);
+    frame.setHeader(headers);
+    frame.setMessageId(messageId);
+    if (!transactionId.isNull())
+        frame.setTransactionId(transactionId);
+    this->sendFrame(std::move(frame));
+}
+
+void QStompClient::flushAcks()
+{
+    P_D(QStompClient);
+    d->writeAcks();
+}
+
+bool QStompClient::isConnected() const
+{
+    const P_D(QStompClient);
+    return !d->m_connectedHeaders.isEmpty();
+}
+
+QString QStompClient::getConnectedStompVersion() const
+{
+    const P_D(QStompClient);
+    return d->m_connectedHeaders.value(Stomp::HeaderConnectedVersion).toString();
+}
+
+QString QStompClient::getConnectedStompServeur() const
+{
+    const P_D(QStompClient);
+    return d->m_connectedHeaders.value(Stomp::HeaderConnectedServer).toString();
+}
+
+QString QStompClient::getConnectedStompSession() const
+{
+    const P_D(QStompClient);
     return d->m_connectedHeaders.value(Stomp::HeaderConnectedSession).toString();
 }
 
@@ -893,6 +1635,37 @@ QString QStompClient::socketErrorString() const
     return d->m_socket->errorString();
 }
 
+void QStompClient::setReceiptTimeout(int msecs)
+{
+    P_D(QStompClient);
+    d->m_receiptTimeout = qMax(0, msecs);
+}
+
+int QStompClient::receiptTimeout() const
+{
+    const P_D(QStompClient);
+    return d->m_receiptTimeout;
+}
+
+void QStompClient::setMaxPendingReceipts(int max)
+{
+    P_D(QStompClient);
+    d->m_maxPendingReceipts = qMax(0, max);
+    d->drainReceiptBacklog();
+}
+
+int QStompClient::maxPendingReceipts() const
+{
+    const P_D(QStompClient);
+    return d->m_maxPendingReceipts;
+}
+
+int QStompClient::pendingReceipts() const
+{
+    const P_D(QStompClient);
+    return d->m_receipts.size();
+}
+
 QByteArray QStompClient::contentEncoding()
 {
     P_D(QStompClient);
@@ -921,6 +1694,7 @@ void QStompClient::disconnectFromHost()
 void QStompClient::stompConnected(QStompResponseFrame frame) {
     P_D(QStompClient);
     d->m_connectedHeaders = frame.header();
+    d->updateSelfSent();
     d->m_outgoingPingInternal = d->m_incomingPongInternal = 0;
     d->m_stompVersion = static_cast<Stomp::Protocol>( Stomp::ProtocolList.indexOf( frame.headerValue(Stomp::HeaderConnectedVersion).toString() ));
 
@@ -932,38 +1706,62 @@ void QStompClient::stompConnected(QStompResponseFrame frame) {
         d->m_incomingPongInternal = heartBeat[0].toInt();
     }
     if(d->m_outgoingPingInternal > 0){
-        qDebug() << "heartBeat outgoing:" << d->m_outgoingPingInternal << "(must send PING to server)";
-        d->m_pingTimer.setInterval(d->m_outgoingPingInternal);
-        d->m_pingTimer.setSingleShot(true);
-        d->m_pingTimer.start(d->m_outgoingPingInternal);
+        qStompDebug(lcStompHeartBeat) << "heartBeat outgoing:" << d->m_outgoingPingInternal << "(must send PING to server)";
+        d->m_lastWrite.start();
+        d->armHeartBeat(d->m_pingTimer, d->m_pingEntry, d->m_outgoingPingInternal);
     }
     if(d->m_incomingPongInternal > 0) {
-        qDebug() << "heartBeat incoming:" << d->m_incomingPongInternal << "(must receive PING from server)";
-        d->m_pongTimer.setInterval(d->m_incomingPongInternal);
-        d->m_pongTimer.setSingleShot(false);
-        d->m_lastReceivedPing = QDateTime::currentDateTime();
-        d->m_pongTimer.start();
+        qStompDebug(lcStompHeartBeat) << "heartBeat incoming:" << d->m_incomingPongInternal << "(must receive PING from server)";
+        d->m_lastRead.start();
+        d->armHeartBeat(d->m_pongTimer, d->m_pongEntry, d->m_incomingPongInternal*2);
     }
 
     doSubcriptions();
+    d->replayOutbox();
     emit frameConnectedReceived();
 }
 
 void QStompClient::stompMessageReceived(const QStompResponseFrame& frame)
 {
     P_D(QStompClient);
+    if(d->m_dedup){
+        QByteArray key = frame.headerValue(d->m_dedupKey).toByteArray();
+        if(!key.isEmpty()){
+            quint64 fingerprint = QStompDedupCache::fingerprint(key);
+            auto it = d->m_subscriptionsById.find(frame.subscriptionId());
+            Stomp::AckType ackType = it != d->m_subscriptionsById.end() ? it.value().d->m_ackType : Stomp::AckAuto;
+            if(d->m_dedup->contains(fingerprint)){
+                d->m_stats->m_duplicates.ref();
+                // Only processed messages are recorded, so the redelivery can be
+                // acked on its own; a cumulative ack would also cover messages
+                // still waiting for their slot
+                if(ackType == Stomp::AckClientIndividual){
+                    if(it.value().d->m_ackWindow > 0)
+                        d->queueAck(it.value().d, frame.messageId());
+                    else
+                        this->ack(frame.messageId());
+                }
+                return;
+            }
+            if(ackType == Stomp::AckAuto){
+                d->m_dedup->insert(fingerprint);
+            }else{
+                d->dedupPending(frame.messageId(), frame.subscriptionId(), fingerprint);
+            }
+        }
+    }
     int fireCount = 0;
     if(frame.hasSubscriptionId()){
-        QString sub_id = frame.subscriptionId();
-        for(QStompSubscription sub : d->m_subscriptions){
-            if(sub.subscriptionFrame().subscriptionId() == sub_id){
-                fireCount++;
-                sub.fireFrameMessage(frame);
-            }
+        auto it = d->m_subscriptionsById.find(frame.subscriptionId());
+        if(it != d->m_subscriptionsById.end()){
+            fireCount++;
+            QSTOMP_TRACE(d->m_stats, TraceRouted, routed, frame.pd_func()->m_frameId, qint64(1));
+            d->dispatchMessage(it.value(), frame);
         }
     }
     if(!frame.hasSubscriptionId() || fireCount==0){
-        qDebug() << "Unable to match subcription. Transmit message to Stomp client";
+        QSTOMP_TRACE(d->m_stats, TraceRouted, routed, frame.pd_func()->m_frameId, qint64(0));
+        qStompDebug(lcStompFrame) << "Unable to match subcription. Transmit message to Stomp client";
         QMetaObject::invokeMethod(this, "frameMessageReceived", Qt::QueuedConnection, Q_ARG(QStompResponseFrame,frame));
     }
 
@@ -972,10 +1770,14 @@ void QStompClient::stompMessageReceived(const QStompResponseFrame& frame)
 bool QStompClient::containsSubcription(const QStompSubscription & sub) const
 {
     const P_D(QStompClient);
-    for(QStompSubscription subElem : d->m_subscriptions){
-        if((sub.d->m_subcriber.isNull() || subElem.d->m_subcriber == sub.d->m_subcriber) &&
-                (sub.d->m_subcribRequestFrame.destination()=="*" || subElem.d->m_subcribRequestFrame.destination()==sub.d->m_subcribRequestFrame.destination()))
-            return true;
+    const QString destination = sub.d->m_subcribRequestFrame.destination();
+    for(auto it = d->m_subscriptionsBySubscriber.constBegin(); it != d->m_subscriptionsBySubscriber.constEnd(); ++it){
+        if(!sub.d->m_subcriber.isNull() && it.key() != sub.d->m_subcriber.data())
+            continue;
+        for(const QStompSubscription &subElem : it.value()){
+            if(destination=="*" || subElem.d->m_subcribRequestFrame.destination()==destination)
+                return true;
+        }
     }
     return false;
 }
@@ -989,8 +1791,10 @@ bool QStompClient::containsSubcription(QObject *subcriber, const QString &destin
 void QStompClient::doSubcriptions()
 {
     P_D(QStompClient);
-    for(QStompSubscription sub : d->m_subscriptions){
-        doSubcription(sub);
+    d->m_subscriptionsById.clear();
+    for(const QList<QStompSubscription> &subs : d->m_subscriptionsBySubscriber){
+        for(QStompSubscription sub : subs)
+            doSubcription(sub);
     }
 }
 
@@ -1001,11 +1805,13 @@ void QStompClient::doSubcription(QStompSubscription & sub)
         if(d->m_stompVersion != Stomp::ProtocolStomp_1_0){
             QString sub_id = QString("sub-%1").arg(d->counter++);
             sub.d->m_subcribRequestFrame.setSubscriptionId(sub_id);
+            d->m_subscriptionsById.insert(sub_id, sub);
             //            sub.d->m_welcomeMessage.setSubscriptionId(sub_id);
         }
         d->send( sub.d->m_subcribRequestFrame.toByteArray().append(Stomp::EndFrame) );
+        d->m_stats->m_framesSent.ref();
         if(sub.d->m_welcomeMessage.isValid()){
-            qDebug() << "Send Welcome MSG";
+            qStompDebug(lcStompFrame) << "Send Welcome MSG";
             sendFrame(sub.d->m_welcomeMessage);
         }
     }
@@ -1014,38 +1820,31 @@ void QStompClient::doSubcription(QStompSubscription & sub)
 void QStompClient::doUnSubcriptions()
 {
     P_D(QStompClient);
-    for(QStompSubscription sub : d->m_subscriptions){
-        doUnSubcription(sub);
+    // All UNSUBSCRIBE frames go out in one write
+    QByteArray serialized;
+    for(const QList<QStompSubscription> &subs : d->m_subscriptionsBySubscriber){
+        for(QStompSubscription sub : subs)
+            serialized += d->unsubscriptionBytes(sub);
     }
+    if(!serialized.isEmpty() && d->send(serialized) != -1)
+        d->m_socket->flush();
 }
 
 void QStompClient::doUnSubcription(QStompSubscription &sub)
 {
     P_D(QStompClient);
-    if(!d->m_connectedHeaders.isEmpty() && sub.subscriptionFrame().hasSubscriptionId()) {
-        QStompRequestFrame reqSub = sub.subscriptionFrame();
-        QStompRequestFrame reqUnSub(Stomp::RequestUnsubscribe);
-        reqUnSub.setSubscriptionId(reqSub.subscriptionId());
-        if(sub.d->m_goodbyeMessage.isValid()) {
-//            qDebug() << "Send GoodBye MSG";
-            sendFrame(sub.d->m_goodbyeMessage);
-        }
-        QByteArray serialized = reqUnSub.toByteArray().append(Stomp::EndFrame);
-//        qDebug() << "Send" << Stomp::RequestCommandList.at(reqUnSub.type())
-//                 << "of" << serialized.size() << "bytes";
-//        qDebug() << serialized;
-        if(d->send( serialized ) != -1){
-            d->m_socket->flush();
-        }
-
-
-        reqSub.removeHeader(Stomp::HeaderRequestSubscription);
-        sub.d->m_subcribRequestFrame = reqSub;
-    }
+    QByteArray serialized = d->unsubscriptionBytes(sub);
+    if(!serialized.isEmpty() && d->send(serialized) != -1)
+        d->m_socket->flush();
 }
 
 void QStompClient::on_socketConnected() {
     P_D(QStompClient);
+    d->m_buffer.clear();
+    d->m_bufferPos = 0;
+    d->m_scan.reset();
+    d->stopOutboxReplay();
+    d->m_bytesQueued = 0;
     // do login
 
     // TODO check required headers
@@ -1057,8 +1856,25 @@ void QStompClient::on_socketConnected() {
 void QStompClient::on_socketDisconnected() {
     P_D(QStompClient);
     d->m_connectedHeaders.clear();
-    d->m_pongTimer.stop();
-    d->m_pingTimer.stop();
+    d->updateSelfSent();
+    d->stopOutboxReplay();
+    // the broker redelivers whatever was not acked on the next session
+    for(const QList<QStompSubscription> &subs : d->m_subscriptionsBySubscriber){
+        for(QStompSubscription sub : subs)
+            d->clearInFlight(sub);
+    }
+    d->m_pendingAckOwners.clear();
+    d->m_ackTimer.stop();
+    d->m_subscriptionsById.clear();
+    d->failAllReceipts();
+    if(d->m_stream.isActive())
+        d->endStream(false);
+    if(d->m_readPaused){
+        d->m_readPaused = false;
+        d->m_stats->m_readPaused.storeRelease(0);
+        d->applyReadLimit(true);
+    }
+    d->stopHeartBeat();
     d->m_incomingPongInternal = d->m_outgoingPingInternal = 0;
 
     emit socketDisconnected();
@@ -1066,148 +1882,1425 @@ void QStompClient::on_socketDisconnected() {
 
 void QStompClient::on_subcriberDestroyed(QObject * subscriber)
 {
+    P_D(QStompClient);
     if(subscriber == nullptr)
         subscriber = sender();
-    QStompSubscription sub(subscriber, "*");
-    unregisterSubscription(sub);
+    if(subscriber != nullptr)
+        d->removeSubscriptions(subscriber, "*");
 }
 
 void QStompClientPrivate::_q_checkPong(){
     if(this->m_socket && this->m_socket->isValid() && this->m_incomingPongInternal > 0){
-        qint64 elapted = this->m_lastReceivedPing.msecsTo(QDateTime::currentDateTime());
-        if(elapted > this->m_incomingPongInternal*2) {
-            qWarning() << "Connexion with server too long time without PING";
+        // Data left unread while paused counts as traffic
+        if(this->m_readPaused && this->m_socket->bytesAvailable() > 0)
+            this->m_lastRead.restart();
+        // The timer only fires at the deadline computed from the last byte read,
+        // so traffic in between costs nothing but restarting m_lastRead
+        qint64 remaining = this->m_incomingPongInternal*2 - this->m_lastRead.elapsed();
+        if(remaining <= 0) {
+            this->m_stats->m_heartBeatMisses.ref();
+            qStompWarning(lcStompHeartBeat) << "Connexion with server too long time without PING";
             this->m_socket->disconnectFromHost();
-            //            this->m_socket->close();
+        }else{
+            this->armHeartBeat(this->m_pongTimer, this->m_pongEntry, int(remaining));
         }
-    }else{
-        // ensure pong Timer is stopped
-        this->m_pongTimer.stop();
     }
 }
 
 void QStompClientPrivate::_q_sendPing(){
-    this->m_pingTimer.stop();
     if(this->m_socket && this->m_socket->isValid() && m_outgoingPingInternal > 0) {
-        qDebug() << "<<< PING";
-        this->send(Stomp::PingContent);
-        this->m_pingTimer.start(m_outgoingPingInternal);
+        qint64 remaining = m_outgoingPingInternal - this->m_lastWrite.elapsed();
+        if(remaining <= 0){
+            // pending acks go out first and stand in for the heart-beat
+            if(this->writeAcks() <= 0){
+                qStompDebug(lcStompHeartBeat) << "<<< PING";
+                this->send(Stomp::PingContent);
+            }
+            remaining = m_outgoingPingInternal;
+        }
+        this->armHeartBeat(this->m_pingTimer, this->m_pingEntry, int(remaining));
     }
 }
 
-qint64 QStompClientPrivate::send(const QByteArray& serialized){
-    if (this->m_socket == nullptr || this->m_socket->state() != QAbstractSocket::ConnectedState)
-        return -1;
-    qint64 bytes = this->m_socket->write(serialized);
-    qDebug() << "Written" << bytes << "bytes";
-    return bytes;
+QStompClientPrivate::~QStompClientPrivate()
+{
+    this->stopHeartBeat();
+    delete this->m_outbox;
+    delete this->m_dedup;
+    delete this->m_capture;
 }
 
-void QStompClientPrivate::_q_socketReadyRead()
+void QStompClientPrivate::replayOutbox()
 {
-    P_Q(QStompClient);
-    QByteArray data = this->m_socket->readAll();
-
-    if(this->m_incomingPongInternal>0 && this->m_buffer.isEmpty() && data == Stomp::PingContent){
-        qDebug() << ">>> PONG";
-        this->m_lastReceivedPing = QDateTime::currentDateTime();
+    // one chunk at a time, the next one follows once the socket wrote it
+    if(this->m_outbox == nullptr || !this->m_outboxRecordEnds.isEmpty())
         return;
+    if(!this->spillOutboxOverflow() && this->m_outbox->isEmpty()){
+        // a frame over the whole disk budget, nothing left to keep it behind
+        while(!this->m_outboxOverflow.isEmpty() && this->send(this->m_outboxOverflow.head()) != -1)
+            this->m_outboxOverflow.dequeue();
+        this->spillOutboxOverflow();
     }
-
-    this->m_buffer.append(data);
-
-    qint32 length;
-    while ((length = this->findMessageBytes())) {
-        QStompResponseFrame frame(this->m_buffer.left(length));
-        if (frame.isValid()) {
-            if(this->m_selfSendFeature){
-                frame.setHeader(Stomp::HeaderResponseSelfSent, frame.headerValue(this->m_selfSendKey) == q->getConnectedStompSession());
-                //                frame.removeHeader(this->m_selfSendKey);
-            }
-            switch(frame.type()) {
-            case Stomp::ResponseConnected :
-                q->stompConnected(frame);
-                break;
-            case Stomp::ResponseMessage :
-                q->stompMessageReceived(frame);
-                break;
-            case Stomp::ResponseReceipt :
-                qDebug() << frame.toByteArray();
-                emit q->frameReceiptReceived(frame);
-                break;
-            case Stomp::ResponseError :
-                qCritical() << frame.toByteArray();
-                emit q->frameErrorReceived(frame);
-                break;
-            default:
-                break;
-            }
-        }
-        else
-            qDebug("QStomp: Invalid frame received!");
-        this->m_buffer.remove(0, length);
+    if(this->m_outbox->isEmpty())
+        return;
+    QVector<int> records;
+    QByteArray chunk = this->m_outbox->read(1024*1024, &records);
+    if(chunk.isEmpty())
+        return;
+    qStompDebug(lcStompIo) << "Replay" << chunk.size() << "of" << this->m_outbox->size() << "bytes from outbox";
+    if(this->send(chunk) == -1){
+        this->m_outbox->rewind(); // kept for the next session
+        return;
+    }
+    qint64 end = this->m_bytesQueued - chunk.size();
+    for(int size : records){
+        end += size;
+        this->m_outboxRecordEnds << end;
     }
+    this->advanceOutbox();
 }
 
-int QStompClientPrivate::findMessageBytes()
+// Moves held back frames into the outbox as far as it has room, true once none is left
+bool QStompClientPrivate::spillOutboxOverflow()
 {
-    // Buffer sanity check
-    forever {
-        if (this->m_buffer.isEmpty())
-            return 0;
-        int nl = this->m_buffer.indexOf('\n');
-        if (nl == -1)
+    while(!this->m_outboxOverflow.isEmpty() && this->m_outbox->append(this->m_outboxOverflow.head()))
+        this->m_outboxOverflow.dequeue();
+    return this->m_outboxOverflow.isEmpty();
+}
+
+// Commits the records the socket has written so far
+void QStompClientPrivate::advanceOutbox()
+{
+    if(this->m_outbox == nullptr || this->m_outboxRecordEnds.isEmpty() || this->m_socket == nullptr)
+        return;
+    qint64 written = this->m_bytesQueued - this->m_socket->bytesToWrite();
+    int done = 0;
+    while(done < this->m_outboxRecordEnds.size() && this->m_outboxRecordEnds.at(done) <= written)
+        done++;
+    if(done == 0)
+        return;
+    this->m_outbox->commit(done);
+    this->m_outboxRecordEnds.remove(0, done);
+    if(this->m_outboxRecordEnds.isEmpty())
+        this->replayOutbox();
+}
+
+void QStompClientPrivate::stopOutboxReplay()
+{
+    this->m_outboxRecordEnds.clear();
+    if(this->m_outbox)
+        this->m_outbox->rewind();
+}
+
+void QStompClientPrivate::armHeartBeat(QTimer &timer, QStompTimerWheelEntry &entry, int msecs)
+{
+    if(this->m_sharedHeartBeatTimer)
+        QStompTimerWheel::instance()->schedule(&entry, msecs);
+    else
+        timer.start(msecs);
+}
+
+void QStompClientPrivate::stopHeartBeat()
+{
+    this->m_pingTimer.stop();
+    this->m_pongTimer.stop();
+    if(this->m_pingEntry.m_wheel)
+        this->m_pingEntry.m_wheel->cancel(&this->m_pingEntry);
+    if(this->m_pongEntry.m_wheel)
+        this->m_pongEntry.m_wheel->cancel(&this->m_pongEntry);
+}
+
+bool QStompClientPrivate::compressible(const QStompRequestFrame &frame) const
+{
+    return this->m_compression && frame.type() == Stomp::RequestSend && !frame.rawBody().isEmpty() &&
+            frame.rawBody().size() >= this->m_compressionThreshold && !frame.headerHasKey(Stomp::HeaderContentCompression);
+}
+
+void QStompClientPrivate::compress(QStompRequestFrame &frame) const
+{
+    frame.setRawBody(qCompress(frame.rawBody(), this->m_compressionLevel));
+    frame.setHeader(Stomp::HeaderContentCompression, Stomp::CompressionZlib);
+    frame.setContentLength(uint(frame.rawBody().size()));
+}
+
+QByteArray QStompClientPrivate::serialize(const QStompRequestFrame &frame) const
+{
+    QByteArray serialized;
+    this->m_stats->m_framesSent.ref();
+    if(this->compressible(frame)){
+        QStompRequestFrame msg = frame;
+        this->compress(msg);
+        serialized = msg.toByteArray();
+    }else{
+        serialized = frame.toByteArray();
+    }
+    // the first occurrence of a header wins, so it goes right after the command
+    if(!this->m_selfSentLine.isEmpty() && frame.type() == Stomp::RequestSend){
+        int eol = serialized.indexOf('\n');
+        if(eol != -1)
+            serialized.insert(eol + 1, this->m_selfSentLine);
+    }
+    return serialized.append(Stomp::EndFrame);
+}
+
+void QStompClientPrivate::updateSelfSent()
+{
+    QByteArray session = this->m_connectedHeaders.value(Stomp::HeaderConnectedSession).toString().toLatin1();
+    QByteArray key = this->m_selfSendKey.toLower().toLatin1();
+    if(this->m_selfSendFeature && !session.isEmpty()){
+        this->m_selfSentMatcher.m_keyPrefix = key + ':';
+        this->m_selfSentMatcher.m_session = session;
+        this->m_selfSentLine = key + ':' + session + '\n';
+    }else{
+        this->m_selfSentMatcher = QStompSelfSentMatcher();
+        this->m_selfSentLine.clear();
+    }
+}
+
+QByteArray QStompClientPrivate::unsubscriptionBytes(QStompSubscription &sub)
+{
+    QByteArray serialized;
+    QStompRequestFrame &reqSub = sub.d->m_subcribRequestFrame;
+    if(this->m_connectedHeaders.isEmpty() || !reqSub.hasSubscriptionId())
+        return serialized;
+
+    QString sub_id = reqSub.subscriptionId();
+    if(sub.d->m_goodbyeMessage.isValid())
+        serialized += this->serialize(sub.d->m_goodbyeMessage);
+    QStompRequestFrame reqUnSub(Stomp::RequestUnsubscribe);
+    reqUnSub.setSubscriptionId(sub_id);
+    serialized += reqUnSub.toByteArray().append(Stomp::EndFrame);
+    this->m_stats->m_framesSent.ref();
+
+    reqSub.removeHeader(Stomp::HeaderRequestSubscription);
+    this->m_subscriptionsById.remove(sub_id);
+    return serialized;
+}
+
+void QStompClientPrivate::removeSubscriptions(QObject *subcriber, const QString &destination)
+{
+    P_Q(QStompClient);
+    // Only the subscriber's own entries are visited, unless every subscriber is targeted
+    QList<QObject*> subcribers;
+    if(subcriber != nullptr)
+        subcribers << subcriber;
+    else
+        subcribers = this->m_subscriptionsBySubscriber.keys();
+
+    QByteArray serialized;
+    for(QObject *key : subcribers){
+        auto it = this->m_subscriptionsBySubscriber.find(key);
+        if(it == this->m_subscriptionsBySubscriber.end())
+            continue;
+
+        QList<QStompSubscription> kept;
+        bool alive = false;
+        for(QStompSubscription elemSub : it.value()){
+            alive = alive || !elemSub.d->m_subcriber.isNull();
+            if(destination == "*" || elemSub.d->m_subcribRequestFrame.destination() == destination){
+                // acks the application already issued go out ahead of the UNSUBSCRIBE
+                if(elemSub.d->m_pendingAckCount > 0){
+                    serialized += this->ackBytes(elemSub.d.data());
+                    this->m_pendingAckOwners.removeAll(elemSub.d);
+                    if(this->m_pendingAckOwners.isEmpty())
+                        this->m_ackTimer.stop();
+                }
+                serialized += this->unsubscriptionBytes(elemSub);
+                for(const QStompResponseFrame &frame : elemSub.d->m_batch)
+                    this->m_stats->m_heldFrameBytes.fetchAndAddRelaxed(-qStompFrameBytes(frame));
+                elemSub.d->m_batch.clear();
+                this->clearInFlight(elemSub);
+            }else{
+                kept << elemSub;
+            }
+        }
+        if(kept.isEmpty()){
+            this->m_subscriptionsBySubscriber.erase(it);
+            if(alive)
+                QObject::disconnect(key, &QObject::destroyed, q, &QStompClient::on_subcriberDestroyed);
+        }else{
+            it.value() = kept;
+        }
+    }
+
+    if(!serialized.isEmpty() && this->send(serialized) != -1)
+        this->m_socket->flush();
+}
+
+void QStompClientPrivate::dispatchMessage(QStompSubscription &sub, const QStompResponseFrame &frame)
+{
+    QStompSubScriptionData *sd = sub.d.data();
+    if(sd->m_flowControl && sd->m_ackType != Stomp::AckAuto &&
+            (!sd->m_backlog.isEmpty() || sd->m_unacked.size() >= sd->m_window)){
+        this->m_stats->m_heldFrameBytes.fetchAndAddRelaxed(qStompFrameBytes(frame));
+        sd->m_backlog.enqueue(frame);
+        return;
+    }
+    this->deliverMessage(sub, frame);
+}
+
+void QStompClientPrivate::deliverMessage(QStompSubscription &sub, const QStompResponseFrame &frame)
+{
+    QStompSubScriptionData *sd = sub.d.data();
+    if((sd->m_flowControl || sd->m_ackWindow > 0) && sd->m_ackType != Stomp::AckAuto){
+        QString messageId = frame.messageId();
+        if(!sd->m_rateClock.isValid())
+            sd->m_rateClock.start();
+        sd->m_unacked.append(messageId);
+        this->m_ackOwners.insert(messageId, sub);
+    }
+    // a batch filled up and flushed in this cycle is already listed
+    if(sd->m_batchDelivery && !sd->m_batchQueued){
+        sd->m_batchQueued = true;
+        this->m_pendingBatches << sub;
+    }
+    sub.fireFrameMessage(frame);
+}
+
+QExplicitlySharedDataPointer<QStompSubScriptionData> QStompClientPrivate::acknowledged(const QString &messageId)
+{
+    auto it = this->m_ackOwners.find(messageId);
+    if(it == this->m_ackOwners.end())
+        return QExplicitlySharedDataPointer<QStompSubScriptionData>();
+    QStompSubscription sub = it.value();
+    QStompSubScriptionData *sd = sub.d.data();
+
+    int released = 0;
+    if(sd->m_ackType == Stomp::AckClient){
+        // cumulative ack, covers every message delivered before this one
+        const QList<QString> acked = sd->m_unacked.takeUpTo(messageId);
+        for(const QString &id : acked)
+            this->m_ackOwners.remove(id);
+        released = acked.size();
+    }else{
+        this->m_ackOwners.erase(it);
+        if(sd->m_unacked.remove(messageId))
+            released = 1;
+    }
+
+    // Window follows roughly one second of consumer work
+    sd->m_ackedInPeriod += released;
+    qint64 elapsed = sd->m_rateClock.elapsed();
+    if(elapsed >= 250){
+        double rate = sd->m_ackedInPeriod * 1000.0 / elapsed;
+        sd->m_ackRate = sd->m_ackRate > 0 ? 0.7 * sd->m_ackRate + 0.3 * rate : rate;
+        sd->m_window = qBound(sd->m_minWindow, qRound(sd->m_ackRate), sd->m_maxWindow);
+        sd->m_ackedInPeriod = 0;
+        sd->m_rateClock.restart();
+    }
+
+    bool drained = false;
+    while(!sd->m_backlog.isEmpty() && sd->m_unacked.size() < sd->m_window){
+        QStompResponseFrame frame = sd->m_backlog.dequeue();
+        this->m_stats->m_heldFrameBytes.fetchAndAddRelaxed(-qStompFrameBytes(frame));
+        this->deliverMessage(sub, frame);
+        drained = true;
+    }
+    if(!this->m_pendingBatches.isEmpty())
+        this->_q_flushBatches();
+    if(drained && this->m_readPaused)
+        this->m_stats->requestMemoryCheck();
+    return sub.d;
+}
+
+void QStompClientPrivate::dedupPending(const QString &messageId, const QString &subscriptionId, quint64 fingerprint)
+{
+    auto it = this->m_dedupPending.find(messageId);
+    if(it != this->m_dedupPending.end()){
+        // delivered again before being acked, only the latest delivery counts
+        auto order = this->m_dedupOrder.find(it->m_subscriptionId);
+        if(order != this->m_dedupOrder.end()){
+            order->remove(it->m_sequence);
+            if(order->isEmpty())
+                this->m_dedupOrder.erase(order);
+        }
+    }else{
+        it = this->m_dedupPending.insert(messageId, QStompDedupPending());
+    }
+    it->m_fingerprint = fingerprint;
+    it->m_subscriptionId = subscriptionId;
+    it->m_sequence = ++this->m_dedupSequence;
+    this->m_dedupOrder[subscriptionId].insert(it->m_sequence, messageId);
+}
+
+void QStompClientPrivate::dedupAcked(const QString &messageId)
+{
+    auto it = this->m_dedupPending.find(messageId);
+    if(it == this->m_dedupPending.end())
+        return;
+    const QStompDedupPending acked = it.value();
+    this->m_dedupPending.erase(it);
+    if(this->m_dedup)
+        this->m_dedup->insert(acked.m_fingerprint);
+
+    auto order = this->m_dedupOrder.find(acked.m_subscriptionId);
+    if(order == this->m_dedupOrder.end())
+        return;
+    auto sub = this->m_subscriptionsById.find(acked.m_subscriptionId);
+    if(sub == this->m_subscriptionsById.end() || sub.value().d->m_ackType != Stomp::AckClient){
+        order->remove(acked.m_sequence);
+    }else{
+        // cumulative ack, covers every message delivered before this one
+        auto pending = order->begin();
+        while(pending != order->end() && pending.key() <= acked.m_sequence){
+            if(pending.key() != acked.m_sequence){
+                auto released = this->m_dedupPending.find(pending.value());
+                if(released != this->m_dedupPending.end()){
+                    if(this->m_dedup)
+                        this->m_dedup->insert(released->m_fingerprint);
+                    this->m_dedupPending.erase(released);
+                }
+            }
+            pending = order->erase(pending);
+        }
+    }
+    if(order->isEmpty())
+        this->m_dedupOrder.erase(order);
+}
+
+void QStompClientPrivate::dedupNacked(const QString &messageId)
+{
+    auto it = this->m_dedupPending.find(messageId);
+    if(it == this->m_dedupPending.end())
+        return;
+    if(this->m_dedup)
+        this->m_dedup->remove(it->m_fingerprint);
+    auto order = this->m_dedupOrder.find(it->m_subscriptionId);
+    if(order != this->m_dedupOrder.end()){
+        order->remove(it->m_sequence);
+        if(order->isEmpty())
+            this->m_dedupOrder.erase(order);
+    }
+    this->m_dedupPending.erase(it);
+}
+
+void QStompClientPrivate::queueAck(const QExplicitlySharedDataPointer<QStompSubScriptionData> &sd, const QString &messageId)
+{
+    if(sd->m_pendingAckCount == 0){
+        this->m_pendingAckOwners << sd;
+        if(!this->m_ackTimer.isActive() || this->m_ackTimer.remainingTime() > sd->m_ackMaxDelay)
+            this->m_ackTimer.start(sd->m_ackMaxDelay);
+    }
+    if(sd->m_ackType == Stomp::AckClient)
+        sd->m_pendingAcks.clear();
+    sd->m_pendingAcks << messageId;
+    if(++sd->m_pendingAckCount >= sd->m_ackWindow)
+        this->writeAcks();
+}
+
+qint64 QStompClientPrivate::writeAcks()
+{
+    if(this->m_pendingAckOwners.isEmpty())
+        return 0;
+
+    QByteArray serialized;
+    for(const QExplicitlySharedDataPointer<QStompSubScriptionData> &sd : this->m_pendingAckOwners)
+        serialized += this->ackBytes(sd.data());
+    this->m_pendingAckOwners.clear();
+    this->m_ackTimer.stop();
+    return this->send(serialized);
+}
+
+// Serializes and forgets the subscription's deferred acks
+QByteArray QStompClientPrivate::ackBytes(QStompSubScriptionData *sd)
+{
+    QByteArray serialized;
+    for(const QString &messageId : sd->m_pendingAcks){
+        QStompRequestFrame frame(Stomp::RequestAck);
+        frame.setMessageId(messageId);
+        serialized += this->serialize(frame);
+    }
+    sd->m_pendingAcks.clear();
+    sd->m_pendingAckCount = 0;
+    return serialized;
+}
+
+void QStompClientPrivate::_q_flushAcks()
+{
+    this->writeAcks();
+}
+
+QStompRequestFrame QStompClientPrivate::sendRequest(const QString &destination, const QString &body, const QString &transactionId, QVariantMap headers) const
+{
+    QStompRequestFrame frame(Stomp::RequestSend);
+    frame.setHeader(std::move(headers));
+    frame.setContentEncoding(this->m_textCodec);
+    frame.setDestination(destination);
+    frame.setBody(body);
+    if (!transactionId.isNull())
+        frame.setTransactionId(transactionId);
+    return frame;
+}
+
+bool QStompClientPrivate::writeReceiptFrame(const QString &receiptId, const QByteArray &serialized)
+{
+    if(this->send(serialized) == -1){
+        this->finishReceipt(receiptId, nullptr);
+        return false;
+    }
+    // a disconnect while writing may have failed it already
+    auto it = this->m_receipts.find(receiptId);
+    if(it == this->m_receipts.end())
+        return false;
+    QStompPendingReceipt &pending = it.value();
+    pending.m_written = true;
+    pending.m_sentAt = this->m_stats->now();
+    this->m_receiptsInFlight++;
+    // the timeout covers the broker, not the time spent in the backlog
+    if(pending.m_timeout > 0){
+        pending.m_deadline = this->m_clock.elapsed() + pending.m_timeout;
+        this->m_receiptDeadlines.insert(pending.m_deadline, receiptId);
+        this->armReceiptTimer();
+    }
+    return true;
+}
+
+void QStompClientPrivate::completeReceipt(const QString &receiptId, const QStompResponseFrame *frame)
+{
+    this->finishReceipt(receiptId, frame);
+    this->drainReceiptBacklog();
+}
+
+// Resolves the future without writing any backlogged frame
+void QStompClientPrivate::finishReceipt(const QString &receiptId, const QStompResponseFrame *frame)
+{
+    auto it = this->m_receipts.find(receiptId);
+    if(it == this->m_receipts.end())
+        return;
+    QStompPendingReceipt pending = it.value();
+    this->m_receipts.erase(it);
+    if(pending.m_deadline != -1)
+        this->m_receiptDeadlines.remove(pending.m_deadline, receiptId);
+    if(pending.m_written)
+        this->m_receiptsInFlight--;
+    this->m_stats->m_pendingReceipts.store(this->m_receipts.size());
+
+    if(frame != nullptr){
+        if(pending.m_written)
+            this->m_stats->m_receiptRoundTrip.record(this->m_stats->now() - pending.m_sentAt);
+        pending.m_promise.reportResult(*frame);
+    }
+    else
+        pending.m_promise.reportCanceled();
+    pending.m_promise.reportFinished();
+}
+
+void QStompClientPrivate::drainReceiptBacklog()
+{
+    while(!this->m_receiptBacklog.isEmpty() && (this->m_maxPendingReceipts == 0 || this->m_receiptsInFlight < this->m_maxPendingReceipts)){
+        QPair<QString, QByteArray> next = this->m_receiptBacklog.dequeue();
+        if(!this->m_receipts.contains(next.first))
+            continue;
+        if(!this->writeReceiptFrame(next.first, next.second)){
+            // the socket is gone, the rest cannot be written either
+            while(!this->m_receiptBacklog.isEmpty())
+                this->finishReceipt(this->m_receiptBacklog.dequeue().first, nullptr);
+            break;
+        }
+    }
+}
+
+void QStompClientPrivate::failAllReceipts()
+{
+    this->m_receiptBacklog.clear();
+    const QList<QString> receiptIds = this->m_receipts.keys();
+    for(const QString &receiptId : receiptIds)
+        this->finishReceipt(receiptId, nullptr);
+    this->m_receiptTimer.stop();
+}
+
+void QStompClientPrivate::armReceiptTimer()
+{
+    if(this->m_receiptDeadlines.isEmpty()){
+        this->m_receiptTimer.stop();
+        return;
+    }
+    qint64 next = this->m_receiptDeadlines.firstKey() - this->m_clock.elapsed();
+    this->m_receiptTimer.start(int(qMax<qint64>(0, next)));
+}
+
+void QStompClientPrivate::_q_checkReceipts()
+{
+    qint64 now = this->m_clock.elapsed();
+    while(!this->m_receiptDeadlines.isEmpty() && this->m_receiptDeadlines.firstKey() <= now){
+        QString receiptId = this->m_receiptDeadlines.first();
+        this->m_receiptDeadlines.erase(this->m_receiptDeadlines.begin());
+        qStompWarning(lcStompFrame) << "No receipt for" << receiptId << "in time";
+        this->m_stats->m_receiptTimeouts.ref();
+        this->completeReceipt(receiptId, nullptr);
+    }
+    this->armReceiptTimer();
+}
+
+void QStompClientPrivate::clearInFlight(QStompSubscription &sub)
+{
+    for(const QString &messageId : sub.d->m_unacked.ids())
+        this->m_ackOwners.remove(messageId);
+    sub.d->m_unacked.clear();
+    for(const QStompResponseFrame &frame : sub.d->m_backlog)
+        this->m_stats->m_heldFrameBytes.fetchAndAddRelaxed(-qStompFrameBytes(frame));
+    sub.d->m_backlog.clear();
+    sub.d->m_pendingAcks.clear();
+    sub.d->m_pendingAckCount = 0;
+
+    // the broker redelivers these, they have to reach a slot again
+    const QString subscriptionId = sub.d->m_subcribRequestFrame.subscriptionId();
+    const QMap<quint64, QString> order = this->m_dedupOrder.take(subscriptionId);
+    for(const QString &messageId : order){
+        auto pending = this->m_dedupPending.find(messageId);
+        if(pending == this->m_dedupPending.end())
+            continue;
+        if(this->m_dedup)
+            this->m_dedup->remove(pending->m_fingerprint);
+        this->m_dedupPending.erase(pending);
+    }
+}
+
+qint64 QStompClientPrivate::send(const QByteArray& serialized){
+    if (this->m_socket == nullptr || this->m_socket->state() != QAbstractSocket::ConnectedState)
+        return -1;
+    qint64 bytes = this->m_socket->write(serialized);
+    if(bytes > 0){
+        this->m_bytesQueued += bytes;
+        this->m_lastWrite.restart();
+        this->m_stats->m_bytesSent.fetchAndAddRelaxed(quint64(bytes));
+        this->m_stats->m_sendQueueBytes.store(this->m_socket->bytesToWrite());
+    }
+    qStompDebug(lcStompIo) << "Written" << bytes << "bytes";
+    return bytes;
+}
+
+void QStompClientPrivate::_q_socketReadyRead()
+{
+    // Left in the socket, whose small read buffer makes TCP push back on the broker
+    if(this->m_readPaused)
+        return;
+    while(this->m_socket->bytesAvailable() > 0){
+        QByteArray data;
+        if(this->m_stream.isActive())
+            data = this->m_socket->read(qMin<qint64>(this->m_socket->bytesAvailable(), this->m_streamChunkSize));
+        else
+            data = this->m_socket->readAll();
+        if(data.isEmpty())
+            break;
+        if(this->m_capture)
+            this->captureSegment(data);
+        this->processIncoming(data);
+        if(this->checkMemoryLimit())
+            break;
+    }
+    this->finishReadCycle();
+}
+
+// Inbound only: pausing reads because our own writes back up could leave
+// both ends blocked on each other
+qint64 QStompClientPrivate::memoryInUse() const
+{
+    return this->m_buffer.size() + this->m_stats->m_pendingDispatchBytes.load() + this->m_stats->m_heldFrameBytes.load();
+}
+
+// Pauses reading when over the limit, returns whether reading is paused
+bool QStompClientPrivate::checkMemoryLimit()
+{
+    if(this->m_readPaused || this->m_memoryLimit <= 0 || this->memoryInUse() <= this->m_memoryLimit)
+        return this->m_readPaused;
+    // a partial frame alone over the limit has nothing that could drain it
+    if(this->m_stats->m_pendingDispatchBytes.load() + this->m_stats->m_heldFrameBytes.load() <= 0)
+        return false;
+    qStompDebug(lcStompIo) << "Pausing reads," << this->memoryInUse() << "bytes in use";
+    this->m_readPaused = true;
+    this->m_stats->m_readPauses.ref();
+    this->m_stats->m_readPaused.storeRelease(1);
+    this->applyReadLimit(false);
+    return true;
+}
+
+// Resumes once usage dropped to three quarters of the limit, so a consumer
+// working at the edge does not toggle reads for every frame. Runs when a
+// queued slot call finished or a backlog drained while paused.
+void QStompClientPrivate::_q_checkMemory()
+{
+    this->m_stats->m_memoryCheckQueued.storeRelease(0);
+    if(!this->m_readPaused)
+        return;
+    if(this->m_memoryLimit > 0 && this->memoryInUse() > this->m_memoryLimit / 4 * 3)
+        return;
+    qStompDebug(lcStompIo) << "Resuming reads," << this->memoryInUse() << "bytes in use";
+    this->m_readPaused = false;
+    this->m_stats->m_readPaused.storeRelease(0);
+    this->applyReadLimit(true);
+    if(this->m_socket && this->m_socket->bytesAvailable() > 0)
+        this->_q_socketReadyRead();
+}
+
+void QStompClientPrivate::_q_socketBytesWritten()
+{
+    if(this->m_socket)
+        this->m_stats->m_sendQueueBytes.store(this->m_socket->bytesToWrite());
+    this->advanceOutbox();
+}
+
+// Keeps the socket's read buffer small while streaming or paused
+void QStompClientPrivate::applyReadLimit(bool wasLimited)
+{
+    bool limited = this->m_stream.isActive() || this->m_readPaused;
+    if(!this->m_socket || limited == wasLimited)
+        return;
+    if(limited){
+        this->m_savedReadBufferSize = this->m_socket->readBufferSize();
+        this->m_socket->setReadBufferSize(this->m_streamChunkSize);
+    }else{
+        this->m_socket->setReadBufferSize(this->m_savedReadBufferSize);
+    }
+}
+
+void QStompClientPrivate::processIncoming(QByteArray data)
+{
+    this->m_lastRead.restart();
+    this->m_stats->m_readStamp = this->m_stats->now();
+    this->m_stats->m_bytesReceived.fetchAndAddRelaxed(quint64(data.size()));
+    QSTOMP_TRACE(this->m_stats, TraceSocketRead, socket_read, quint64(0), qint64(data.size()));
+
+    if(this->m_stream.isActive()){
+        int consumed = this->feedStream(data.constData(), data.size());
+        if(consumed == data.size())
+            return;
+        data.remove(0, consumed);
+    }
+    this->m_buffer.append(data);
+    this->decodeBuffer();
+}
+
+void QStompClientPrivate::finishReadCycle()
+{
+    this->m_stats->m_receiveBufferBytes.store(this->m_buffer.size());
+
+    // Hand over everything decoded for batch subscriptions during this read cycle
+    if(!this->m_pendingBatches.isEmpty())
+        this->_q_flushBatches();
+}
+
+void QStompClientPrivate::captureSegment(const QByteArray &data)
+{
+    char header[12];
+    qToLittleEndian<quint64>(quint64(this->m_captureClock.nsecsElapsed()), header);
+    qToLittleEndian<quint32>(quint32(data.size()), header + 8);
+    if(this->m_capture->write(header, sizeof(header)) != qint64(sizeof(header)) || this->m_capture->write(data) != data.size()){
+        qStompWarning(lcStompIo) << "Capture stopped:" << this->m_capture->errorString();
+        delete this->m_capture;
+        this->m_capture = nullptr;
+    }
+}
+
+void QStompClientPrivate::decodeBuffer()
+{
+    P_Q(QStompClient);
+    qint32 length;
+    forever {
+        length = this->findMessageBytes();
+        if(length == 0){
+            // an incomplete frame may be a large message to stream
+            if(!this->m_stream.isActive() && this->beginStream())
+                continue;
+            if(this->frameTooLarge()){
+                qStompWarning(lcStompIo) << "Frame exceeds" << this->m_maxFrameSize << "bytes, closing the connection";
+                this->m_buffer.clear();
+                this->m_bufferPos = 0;
+                this->m_scan.reset();
+                if(this->m_socket)
+                    this->m_socket->abort();
+                return;
+            }
+            break;
+        }
+        qint64 parseStart = this->m_stats->now();
+        QStompResponseFrame frame(this->m_buffer.mid(this->m_bufferPos, length),
+                                  this->m_selfSentLine.isEmpty() ? nullptr : &this->m_selfSentMatcher, this->m_maxFrameSize);
+        this->m_stats->m_parseTime.record(this->m_stats->now() - parseStart);
+        frame.pd_func()->m_readStamp = this->m_stats->m_readStamp;
+        frame.pd_func()->m_frameId = ++this->m_stats->m_frameId;
+        this->m_stats->m_framesReceived.ref();
+        QSTOMP_TRACE(this->m_stats, TraceFrameComplete, frame_complete, frame.pd_func()->m_frameId, qint64(length));
+        if (frame.isValid()) {
+            switch(frame.type()) {
+            case Stomp::ResponseConnected :
+                q->stompConnected(frame);
+                break;
+            case Stomp::ResponseMessage :
+                this->m_stats->m_messagesReceived.ref();
+                q->stompMessageReceived(frame);
+                break;
+            case Stomp::ResponseReceipt :
+                qStompDebug(lcStompFrame) << frame.toByteArray();
+                this->completeReceipt(frame.receiptId(), &frame);
+                emit q->frameReceiptReceived(frame);
+                break;
+            case Stomp::ResponseError :
+                qStompCritical(lcStompFrame) << frame.toByteArray();
+                if(frame.hasReceiptId())
+                    this->completeReceipt(frame.receiptId(), &frame);
+                emit q->frameErrorReceived(frame);
+                break;
+            default:
+                break;
+            }
+        }
+        else {
+            this->m_stats->m_parseErrors.ref();
+            qStompDebug(lcStompFrame) << "Invalid frame received!";
+        }
+        this->m_bufferPos += length;
+    }
+    this->compactBuffer();
+}
+
+bool QStompClientPrivate::beginStream()
+{
+    // the header is looked at once per frame
+    int headerEnd = this->m_scan.m_headerEnd;
+    if(headerEnd == -1 || this->m_scan.m_streamChecked)
+        return false;
+    this->m_scan.m_streamChecked = true;
+    if(this->m_scan.m_frameLength < 0 || this->m_buffer.mid(this->m_bufferPos, 8) != "MESSAGE\n")
+        return false;
+
+    // Only parse the header for a subscription that streams; an escaped id
+    // is left to the parser
+    const QByteArray headerBytes = QByteArray::fromRawData(this->m_buffer.constData() + this->m_bufferPos, headerEnd + 1 - this->m_bufferPos);
+    int key = headerBytes.indexOf("\nsubscription:");
+    if(key == -1)
+        return false;
+    int valueStart = key + 14;
+    QByteArray id = headerBytes.mid(valueStart, headerBytes.indexOf('\n', valueStart) - valueStart);
+    if(id.endsWith('\r'))
+        id.chop(1);
+    if(!id.contains('\\')){
+        auto sub = this->m_subscriptionsById.constFind(QString::fromUtf8(id));
+        if(sub == this->m_subscriptionsById.constEnd() || sub.value().d->m_streamThreshold <= 0)
+            return false;
+    }
+
+    QStompResponseFrame header(this->m_buffer.mid(this->m_bufferPos, headerEnd + 2 - this->m_bufferPos),
+                               this->m_selfSentLine.isEmpty() ? nullptr : &this->m_selfSentMatcher, this->m_maxFrameSize);
+    if(!header.isValid() || !header.hasContentLength() || !header.hasSubscriptionId()
+            || header.headerHasKey(Stomp::HeaderContentCompression))
+        return false;
+    auto it = this->m_subscriptionsById.find(header.subscriptionId());
+    if(it == this->m_subscriptionsById.end())
+        return false;
+    QStompSubScriptionData *sd = it.value().d.data();
+    if(sd->m_streamThreshold <= 0 || header.contentLength() < sd->m_streamThreshold)
+        return false;
+
+    bool wasLimited = this->m_readPaused;
+    header.pd_func()->m_readStamp = this->m_stats->m_readStamp;
+    header.pd_func()->m_frameId = ++this->m_stats->m_frameId;
+    this->m_stream.m_sub = it.value().d;
+    this->m_stream.m_header = header;
+    this->m_stream.m_remaining = header.contentLength();
+    this->m_buffer.remove(0, headerEnd + 2);
+    this->m_bufferPos = 0;
+    this->m_scan.reset();
+
+    // Let TCP push back on the broker instead of buffering the body in the socket
+    this->applyReadLimit(wasLimited);
+
+    int consumed = this->feedStream(this->m_buffer.constData(), this->m_buffer.size());
+    this->m_buffer.remove(0, consumed);
+    return true;
+}
+
+int QStompClientPrivate::feedStream(const char *data, int size)
+{
+    QStompSubScriptionData *sd = this->m_stream.m_sub.data();
+    int consumed = 0;
+    while(consumed < size && this->m_stream.m_remaining > 0){
+        int n = int(qMin<qint64>(qMin(size - consumed, this->m_streamChunkSize), this->m_stream.m_remaining));
+        QByteArray chunk = QByteArray::fromRawData(data + consumed, n);
+        this->m_stream.m_remaining -= n;
+        consumed += n;
+        if(sd->m_streamDevice)
+            sd->m_streamDevice->write(chunk);
+        else if(sd->m_streamHandler)
+            sd->m_streamHandler(this->m_stream.m_header, chunk, this->m_stream.m_remaining == 0);
+    }
+    if(this->m_stream.m_remaining == 0 && consumed < size){
+        if(data[consumed] == '\0')
+            consumed++;
+        this->endStream(true);
+    }
+    return consumed;
+}
+
+void QStompClientPrivate::endStream(bool dispatch)
+{
+    P_Q(QStompClient);
+    QStompResponseFrame header = this->m_stream.m_header;
+    this->m_stream = QStompStreamState();
+    this->applyReadLimit(true);
+    if(dispatch)
+        q->stompMessageReceived(header);
+}
+
+void QStompClientPrivate::_q_flushBatches()
+{
+    qint64 nextLinger = -1;
+    QList<QStompSubscription> lingering;
+    for(QStompSubscription sub : this->m_pendingBatches){
+        sub.d->m_batchQueued = false;
+        if(sub.d->m_batch.isEmpty())
+            continue;
+        qint64 remaining = sub.d->m_batchMaxLinger - sub.d->m_batchAge.elapsed();
+        if(remaining <= 0){
+            sub.flushBatch();
+        }else{
+            sub.d->m_batchQueued = true;
+            lingering << sub;
+            nextLinger = nextLinger == -1 ? remaining : qMin(nextLinger, remaining);
+        }
+    }
+    this->m_pendingBatches = lingering;
+    if(nextLinger >= 0)
+        this->m_batchTimer.start(int(nextLinger));
+    else
+        this->m_batchTimer.stop();
+}
+
+// Skips heart-beats and anything that does not start with a known command;
+// returns false until a complete command line is at m_bufferPos
+bool QStompClientPrivate::resyncBuffer()
+{
+    const int size = this->m_buffer.size();
+    forever {
+        // Heart-beats are bare EOLs between frames
+        while (this->m_bufferPos < size && (this->m_buffer.at(this->m_bufferPos) == '\n' || this->m_buffer.at(this->m_bufferPos) == '\r'))
+            ++this->m_bufferPos;
+        if (this->m_bufferPos == size)
+            return false;
+        int nl = this->m_buffer.indexOf('\n', this->m_bufferPos);
+        if (nl == -1)
+            return false;
+        if (Stomp::ResponseCommandList.contains(QString::fromLatin1(this->m_buffer.constData() + this->m_bufferPos, nl - this->m_bufferPos)))
+            return true;
+        qStompDebug(lcStompFrame) << "Framebuffer corrupted, repairing...";
+        this->m_stats->m_resyncs.ref();
+        // the EOL after the terminator is skipped as a heart-beat
+        int syncPos = this->m_buffer.indexOf('\0', this->m_bufferPos);
+        this->m_bufferPos = syncPos != -1 ? syncPos + 1 : size;
+    }
+}
+
+// Returns the length of the complete frame at m_bufferPos, or 0. Scanning
+// resumes where the previous call stopped, so a frame arriving in many
+// pieces is only searched once.
+int QStompClientPrivate::findMessageBytes()
+{
+    QStompFrameScan &scan = this->m_scan;
+    if (scan.m_headerEnd == -1) {
+        if (!this->resyncBuffer())
+            return 0;
+        int headerEnd = this->m_buffer.indexOf("\n\n", qMax(this->m_bufferPos, scan.m_offset));
+        if (headerEnd == -1) {
+            scan.m_offset = qMax(this->m_bufferPos, this->m_buffer.size() - 1);
+            return 0;
+        }
+        scan.m_headerEnd = headerEnd;
+        scan.m_offset = headerEnd + 2;
+
+        // Look for content-length
+        QByteArray header = QByteArray::fromRawData(this->m_buffer.constData() + this->m_bufferPos, headerEnd - this->m_bufferPos + 1);
+        int clPos = header.indexOf("\ncontent-length:");
+        if (clPos != -1) {
+            int valueStart = clPos + 16;
+            int nl = header.indexOf('\n', valueStart);
+            bool ok = false;
+            qint64 cl = header.mid(valueStart, nl - valueStart).trimmed().toLongLong(&ok);
+            if (ok && cl >= 0)
+                scan.m_frameLength = cl + headerEnd + 2 - this->m_bufferPos;
+        }
+    }
+
+    int available = this->m_buffer.size() - this->m_bufferPos;
+    int length;
+    if (scan.m_frameLength >= 0) {
+        // the terminating NUL belongs to the frame as well
+        if (available <= scan.m_frameLength)
+            return 0;
+        length = int(scan.m_frameLength);
+        if (this->m_buffer.at(this->m_bufferPos + length) == '\0')
+            ++length;
+    } else {
+        int end = this->m_buffer.indexOf('\0', scan.m_offset);
+        if (end == -1) {
+            scan.m_offset = this->m_buffer.size();
+            return 0;
+        }
+        length = end + 1 - this->m_bufferPos;
+    }
+    scan.reset();
+    return length;
+}
+
+bool QStompClientPrivate::frameTooLarge() const
+{
+    if (this->m_maxFrameSize <= 0 || this->m_stream.isActive())
+        return false;
+    return this->m_scan.m_frameLength > this->m_maxFrameSize ||
+            this->m_buffer.size() - this->m_bufferPos > this->m_maxFrameSize;
+}
+
+void QStompClientPrivate::compactBuffer()
+{
+    if (this->m_bufferPos == 0)
+        return;
+    this->m_buffer.remove(0, this->m_bufferPos);
+    if (this->m_scan.m_headerEnd != -1)
+        this->m_scan.m_headerEnd -= this->m_bufferPos;
+    this->m_scan.m_offset = qMax(0, this->m_scan.m_offset - this->m_bufferPos);
+    this->m_bufferPos = 0;
+}
+
+static const qint64 OutboxSegmentSize = 4*1024*1024;
+static const quint32 OutboxRecordSent = 0x80000000u;
+
+QStompOutbox::QStompOutbox(const QString &directory, qint64 maxBytes) : m_directory(directory), m_maxBytes(maxBytes),
+    m_segmentSize(qMin(OutboxSegmentSize, maxBytes)), m_diskUsage(0), m_pending(0), m_nextIndex(0),
+    m_readSegment(0), m_readPos(0)
+{
+}
+
+QStompOutbox::~QStompOutbox()
+{
+    for(Segment *segment : this->m_segments)
+        this->closeSegment(segment, false);
+}
+
+bool QStompOutbox::open()
+{
+    QDir dir(this->m_directory);
+    if(!dir.mkpath("."))
+        return false;
+
+    // Recovery scan: keep every complete record left by a previous run
+    const QStringList names = dir.entryList(QStringList() << "outbox-*.seg", QDir::Files, QDir::Name);
+    for(const QString &name : names){
+        QFile *file = new QFile(dir.filePath(name));
+        uchar *map = nullptr;
+        if(file->open(QIODevice::ReadWrite) && file->size() > 0)
+            map = file->map(0, file->size());
+        if(map == nullptr){
+            delete file;
+            continue;
+        }
+        Segment *segment = new Segment;
+        segment->file = file;
+        segment->map = map;
+        segment->capacity = file->size();
+        segment->used = 0;
+        segment->consumed = 0;
+        while(segment->used + 4 <= segment->capacity){
+            quint32 field = qFromLittleEndian<quint32>(map + segment->used);
+            quint32 len = field & ~OutboxRecordSent;
+            if(len == 0 || segment->used + 4 + len > segment->capacity)
+                break;
+            segment->used += 4 + len;
+            if(field & OutboxRecordSent)
+                segment->consumed = segment->used;
+            else
+                this->m_pending += len;
+        }
+        this->m_diskUsage += segment->capacity;
+        this->m_segments << segment;
+        this->m_nextIndex = qMax(this->m_nextIndex, name.mid(7, 6).toInt() + 1);
+    }
+    this->dropConsumed();
+    this->rewind();
+    return true;
+}
+
+bool QStompOutbox::append(const QByteArray &serialized)
+{
+    qint64 needed = serialized.size() + 4;
+    Segment *segment = this->m_segments.isEmpty() ? nullptr : this->m_segments.last();
+    if(segment == nullptr || segment->used + needed + 4 > segment->capacity){
+        segment = this->addSegment(qMax(this->m_segmentSize, needed + 4));
+        if(segment == nullptr)
+            return false;
+    }
+
+    // Payload before length, a torn record is never picked up by the recovery scan
+    memcpy(segment->map + segment->used + 4, serialized.constData(), size_t(serialized.size()));
+    qToLittleEndian<quint32>(quint32(serialized.size()), segment->map + segment->used);
+    segment->used += needed;
+    this->m_pending += serialized.size();
+    return true;
+}
+
+bool QStompOutbox::isEmpty() const
+{
+    return this->m_pending == 0;
+}
+
+qint64 QStompOutbox::size() const
+{
+    return this->m_pending;
+}
+
+QString QStompOutbox::directory() const
+{
+    return this->m_directory;
+}
+
+QByteArray QStompOutbox::read(int chunkSize, QVector<int> *records)
+{
+    QByteArray chunk;
+    while(this->m_readSegment < this->m_segments.size()){
+        const Segment *segment = this->m_segments.at(this->m_readSegment);
+        if(this->m_readPos >= segment->used){
+            this->m_readSegment++;
+            this->m_readPos = 0;
+            continue;
+        }
+        quint32 len = qFromLittleEndian<quint32>(segment->map + this->m_readPos) & ~OutboxRecordSent;
+        if(!chunk.isEmpty() && chunk.size() + qint64(len) > chunkSize)
             break;
-        QByteArray cmd = this->m_buffer.left(nl);
-        if (Stomp::ResponseCommandList.contains(cmd))
+        chunk.append(reinterpret_cast<const char*>(segment->map + this->m_readPos + 4), int(len));
+        records->append(int(len));
+        this->m_readPos += 4 + len;
+    }
+    return chunk;
+}
+
+void QStompOutbox::commit(int records)
+{
+    while(records > 0 && !this->m_segments.isEmpty()){
+        Segment *segment = this->m_segments.first();
+        if(segment->consumed >= segment->used){
+            if(this->m_segments.size() == 1)
+                break;
+            this->dropConsumed();
+            continue;
+        }
+        uchar *field = segment->map + segment->consumed;
+        quint32 len = qFromLittleEndian<quint32>(field) & ~OutboxRecordSent;
+        qToLittleEndian<quint32>(len | OutboxRecordSent, field);
+        segment->consumed += 4 + len;
+        this->m_pending -= len;
+        records--;
+    }
+    this->dropConsumed();
+}
+
+void QStompOutbox::rewind()
+{
+    this->m_readSegment = 0;
+    this->m_readPos = this->m_segments.isEmpty() ? 0 : this->m_segments.first()->consumed;
+}
+
+// Removes leading segments whose records were all sent; the last one only
+// when nothing is left, appends then start a fresh segment
+void QStompOutbox::dropConsumed()
+{
+    while(!this->m_segments.isEmpty()){
+        Segment *segment = this->m_segments.first();
+        if(segment->consumed < segment->used || (this->m_segments.size() == 1 && this->m_pending > 0))
             break;
-        else {
-            qDebug("QStomp: Framebuffer corrupted, repairing...");
-            int syncPos = this->m_buffer.indexOf(QByteArray("\0\n", 2));
-            if (syncPos != -1)
-                this->m_buffer.remove(0, syncPos+2);
-            else {
-                syncPos = this->m_buffer.indexOf(QByteArray("\0", 1));
-                if (syncPos != -1)
-                    this->m_buffer.remove(0, syncPos+1);
-                else
-                    this->m_buffer.clear();
-            }
+        this->m_diskUsage -= segment->capacity;
+        this->closeSegment(segment, true);
+        this->m_segments.removeFirst();
+        if(this->m_readSegment > 0){
+            this->m_readSegment--;
+        }else{
+            this->m_readPos = this->m_segments.isEmpty() ? 0 : this->m_segments.first()->consumed;
         }
     }
+    if(this->m_segments.isEmpty())
+        this->m_nextIndex = 0;
+}
 
-    // Look for content-length
-    int headerEnd = this->m_buffer.indexOf("\n\n");
-    int clPos = this->m_buffer.indexOf("\ncontent-length");
-    if (clPos != -1 && headerEnd != -1 && clPos < headerEnd) {
-        int colon = this->m_buffer.indexOf(':', clPos);
-        int nl = this->m_buffer.indexOf('\n', clPos);
-        if (colon != -1 && nl != -1 && nl > colon) {
-            bool ok = false;
-            int cl = this->m_buffer.mid(colon, nl-colon).toInt(&ok) + headerEnd+2;
-            if (ok) {
-                if (this->m_buffer.size() >= cl)
-                    return cl;
-                else
-                    return 0;
-            }
+QStompOutbox::Segment * QStompOutbox::addSegment(qint64 capacity)
+{
+    if(this->m_diskUsage + capacity > this->m_maxBytes)
+        return nullptr;
+
+    QFile *file = new QFile(QDir(this->m_directory).filePath(QString("outbox-%1.seg").arg(this->m_nextIndex, 6, 10, QChar('0'))));
+    uchar *map = nullptr;
+    // resize() zero fills, which gives every fresh segment its end marker
+    if(file->open(QIODevice::ReadWrite | QIODevice::Truncate) && file->resize(capacity))
+        map = file->map(0, capacity);
+    if(map == nullptr){
+        qStompWarning(lcStompIo) << "Unable to map outbox segment" << file->fileName() << file->errorString();
+        file->remove();
+        delete file;
+        return nullptr;
+    }
+
+    Segment *segment = new Segment;
+    segment->file = file;
+    segment->map = map;
+    segment->capacity = capacity;
+    segment->used = 0;
+    segment->consumed = 0;
+    this->m_nextIndex++;
+    this->m_diskUsage += capacity;
+    this->m_segments << segment;
+    return segment;
+}
+
+void QStompOutbox::closeSegment(Segment *segment, bool remove)
+{
+    segment->file->unmap(segment->map);
+    segment->file->close();
+    if(remove)
+        segment->file->remove();
+    delete segment->file;
+    delete segment;
+}
+
+void QStompInFlight::append(const QString &messageId)
+{
+    if(this->m_sequences.contains(messageId))
+        return;
+    this->m_sequences.insert(messageId, ++this->m_sequence);
+    this->m_order.insert(this->m_sequence, messageId);
+}
+
+bool QStompInFlight::remove(const QString &messageId)
+{
+    auto it = this->m_sequences.find(messageId);
+    if(it == this->m_sequences.end())
+        return false;
+    this->m_order.remove(it.value());
+    this->m_sequences.erase(it);
+    return true;
+}
+
+QList<QString> QStompInFlight::takeUpTo(const QString &messageId)
+{
+    QList<QString> taken;
+    auto it = this->m_sequences.constFind(messageId);
+    if(it == this->m_sequences.constEnd())
+        return taken;
+    quint64 last = it.value();
+    auto order = this->m_order.begin();
+    while(order != this->m_order.end() && order.key() <= last){
+        taken << order.value();
+        this->m_sequences.remove(order.value());
+        order = this->m_order.erase(order);
+    }
+    return taken;
+}
+
+QStompDedupCache::QStompDedupCache(int capacity) : m_ring(capacity, 0), m_head(0), m_count(0)
+{
+    // keep the table at most half full
+    int tableSize = 2;
+    while(tableSize < capacity * 2)
+        tableSize <<= 1;
+    this->m_table = QVector<quint64>(tableSize, 0);
+    this->m_mask = tableSize - 1;
+}
+
+bool QStompDedupCache::insert(quint64 fingerprint)
+{
+    if(this->find(fingerprint) != -1)
+        return false;
+
+    if(this->m_count == this->m_ring.size())
+        this->remove(this->m_ring.at(this->m_head));
+    else
+        this->m_count++;
+    this->m_ring[this->m_head] = fingerprint;
+    this->m_head = (this->m_head + 1) % this->m_ring.size();
+
+    int slot = int(fingerprint & quint64(this->m_mask));
+    while(this->m_table.at(slot) != 0)
+        slot = (slot + 1) & this->m_mask;
+    this->m_table[slot] = fingerprint;
+    return true;
+}
+
+bool QStompDedupCache::contains(quint64 fingerprint) const
+{
+    return this->find(fingerprint) != -1;
+}
+
+int QStompDedupCache::capacity() const
+{
+    return this->m_ring.size();
+}
+
+qint64 QStompDedupCache::memoryUsage() const
+{
+    return qint64(this->m_table.size() + this->m_ring.size()) * sizeof(quint64);
+}
+
+double QStompDedupCache::falsePositiveRate() const
+{
+    // a lookup collides with one of the stored 64 bit fingerprints
+    return this->m_count / 18446744073709551616.0;
+}
+
+quint64 QStompDedupCache::fingerprint(const QByteArray &key)
+{
+    // FNV-1a, 0 is reserved for empty slots
+    quint64 hash = Q_UINT64_C(14695981039346656037);
+    for(char c : key){
+        hash ^= quint8(c);
+        hash *= Q_UINT64_C(1099511628211);
+    }
+    return hash ? hash : 1;
+}
+
+int QStompDedupCache::find(quint64 fingerprint) const
+{
+    int slot = int(fingerprint & quint64(this->m_mask));
+    while(this->m_table.at(slot) != 0){
+        if(this->m_table.at(slot) == fingerprint)
+            return slot;
+        slot = (slot + 1) & this->m_mask;
+    }
+    return -1;
+}
+
+void QStompDedupCache::remove(quint64 fingerprint)
+{
+    int slot = this->find(fingerprint);
+    if(slot == -1)
+        return;
+
+    // Backward shift deletion keeps probe chains intact without tombstones
+    int next = (slot + 1) & this->m_mask;
+    while(this->m_table.at(next) != 0){
+        int home = int(this->m_table.at(next) & quint64(this->m_mask));
+        if(((next - home) & this->m_mask) >= ((next - slot) & this->m_mask)){
+            this->m_table[slot] = this->m_table.at(next);
+            slot = next;
         }
+        next = (next + 1) & this->m_mask;
     }
+    this->m_table[slot] = 0;
+}
 
-    // No content-length, look for \0\n
-    int end = this->m_buffer.indexOf(QByteArray("\0\n", 2));
-    if (end == -1) {
-        // look for \0
-        end = this->m_buffer.indexOf(QByteArray("\0", 1));
-        if (end == -1)
-            return 0;
-        else
-            return end+1;
+static const int TimerWheelResolution = 100; // ms per tick
+static const int TimerWheelSize = 512;
+
+QStompTimerWheel * QStompTimerWheel::instance()
+{
+    static QThreadStorage<QStompTimerWheel*> wheels;
+    if(!wheels.hasLocalData())
+        wheels.setLocalData(new QStompTimerWheel);
+    return wheels.localData();
+}
+
+QStompTimerWheel::QStompTimerWheel() : m_buckets(TimerWheelSize, nullptr), m_cursor(0), m_count(0)
+{
+}
+
+void QStompTimerWheel::schedule(QStompTimerWheelEntry *entry, int msecs)
+{
+    this->cancel(entry);
+
+    // Round down, callers check their real deadline and re-arm for the rest
+    int ticks = qMax(1, msecs / TimerWheelResolution);
+    int bucket = (this->m_cursor + ticks) % TimerWheelSize;
+    entry->m_rounds = (ticks - 1) / TimerWheelSize;
+    entry->m_bucket = bucket;
+    entry->m_wheel = this;
+    entry->m_prev = nullptr;
+    entry->m_next = this->m_buckets[bucket];
+    if(entry->m_next)
+        entry->m_next->m_prev = entry;
+    this->m_buckets[bucket] = entry;
+
+    if(this->m_count++ == 0)
+        this->m_timer.start(TimerWheelResolution, Qt::CoarseTimer, this);
+}
+
+void QStompTimerWheel::cancel(QStompTimerWheelEntry *entry)
+{
+    if(entry->m_wheel != this)
+        return;
+    if(entry->m_bucket >= 0){
+        this->unlink(entry);
+    }else if(entry->m_bucket == QStompTimerWheelEntry::Due){
+        int idx = this->m_due.indexOf(entry);
+        if(idx != -1)
+            this->m_due[idx] = nullptr;
     }
+    entry->m_bucket = QStompTimerWheelEntry::Idle;
+    entry->m_wheel = nullptr;
+}
+
+void QStompTimerWheel::unlink(QStompTimerWheelEntry *entry)
+{
+    if(entry->m_prev)
+        entry->m_prev->m_next = entry->m_next;
     else
-        return end+2;
+        this->m_buckets[entry->m_bucket] = entry->m_next;
+    if(entry->m_next)
+        entry->m_next->m_prev = entry->m_prev;
+    entry->m_prev = entry->m_next = nullptr;
+    entry->m_bucket = QStompTimerWheelEntry::Idle;
+    if(--this->m_count == 0)
+        this->m_timer.stop();
+}
+
+void QStompTimerWheel::timerEvent(QTimerEvent *event)
+{
+    if(event->timerId() != this->m_timer.timerId()){
+        QObject::timerEvent(event);
+        return;
+    }
+
+    this->m_cursor = (this->m_cursor + 1) % TimerWheelSize;
+    QStompTimerWheelEntry *entry = this->m_buckets[this->m_cursor];
+    while(entry){
+        QStompTimerWheelEntry *next = entry->m_next;
+        if(entry->m_rounds > 0){
+            entry->m_rounds--;
+        }else{
+            this->unlink(entry);
+            entry->m_bucket = QStompTimerWheelEntry::Due;
+            this->m_due << entry;
+        }
+        entry = next;
+    }
+
+    // Callbacks may cancel or re-arm any entry, including the due ones
+    for(int i = 0; i < this->m_due.size(); ++i){
+        QStompTimerWheelEntry *due = this->m_due.at(i);
+        if(due == nullptr)
+            continue;
+        this->m_due[i] = nullptr;
+        due->m_bucket = QStompTimerWheelEntry::Idle;
+        due->m_wheel = nullptr;
+        (due->m_client->*due->m_callback)();
+    }
+    this->m_due.clear();
 }
 
+// Queues the slot call through a functor so the client's statistics see when it starts
+template<typename T>
+static void qStompInvokeSlot(QStompSubScriptionData *d, const char *typeName, const T &value, qint64 bytes, qint64 readStamp, quint64 frameId)
+{
+    if(!d->m_stats){
+        d->m_slotMethod.invoke(d->m_subcriber, Qt::QueuedConnection, QArgument<T>(typeName, value));
+        return;
+    }
+    QSharedPointer<QStompDispatchTicket> ticket(new QStompDispatchTicket(d->m_stats, bytes, readStamp, frameId));
+    QPointer<QObject> subscriber = d->m_subcriber;
+    QMetaMethod method = d->m_slotMethod;
+    QSTOMP_TRACE(d->m_stats, TraceDispatchQueued, dispatch_queued, ticket->m_frameId, qint64(0));
+    QMetaObject::invokeMethod(subscriber.data(), [ticket, subscriber, method, typeName, value]() {
+        QStompStatisticsData *stats = ticket->m_stats.data();
+        stats->m_dispatchLatency.record(stats->now() - ticket->m_readStamp);
+        QSTOMP_TRACE(stats, TraceSlotEntry, slot_entry, ticket->m_frameId, qint64(0));
+        if(subscriber)
+            method.invoke(subscriber.data(), Qt::DirectConnection, QArgument<T>(typeName, value));
+        QSTOMP_TRACE(stats, TraceSlotExit, slot_exit, ticket->m_frameId, qint64(0));
+    }, Qt::QueuedConnection);
+}
 
 QStompSubscription::QStompSubscription(QObject *subcriber, const QString &destination, const QVariantMap &headers)
     : d(new QStompSubScriptionData)
@@ -1226,7 +3319,8 @@ QStompSubscription::QStompSubscription(QObject *subcriber, const char *subcriber
     d->m_subcribRequestFrame.setHeader(headers);
     d->m_subcribRequestFrame.setDestination(destination);
     int ackIdx = Stomp::AckTypeList.indexOf(ack);
-    d->m_subcribRequestFrame.setAckType( ackIdx>=0 ? static_cast<Stomp::AckType>(ackIdx) : Stomp::AckAuto );
+    d->m_ackType = ackIdx>=0 ? static_cast<Stomp::AckType>(ackIdx) : Stomp::AckAuto;
+    d->m_subcribRequestFrame.setAckType(d->m_ackType);
     assignMethodSlot(subcriberSlot);
 }
 
@@ -1237,6 +3331,7 @@ QStompSubscription::QStompSubscription( QObject *subcriber, const char* subcribe
     d->m_subcribRequestFrame = QStompRequestFrame(Stomp::RequestSubscribe);
     d->m_subcribRequestFrame.setHeader(headers);
     d->m_subcribRequestFrame.setDestination(destination);
+    d->m_ackType = ack;
     d->m_subcribRequestFrame.setAckType(ack);
 
     assignMethodSlot(subcriberSlot);
@@ -1281,6 +3376,99 @@ void QStompSubscription::resetGoodByeMessage()
     d->m_goodbyeMessage = QStompRequestFrame();
 }
 
+void QStompSubscription::setBatchDelivery(int maxBatchSize, int maxLingerMs)
+{
+    d->m_batchMaxSize = qMax(0, maxBatchSize);
+    d->m_batchMaxLinger = qMax(0, maxLingerMs);
+}
+
+bool QStompSubscription::isBatchDelivery() const
+{
+    return d->m_batchDelivery;
+}
+
+int QStompSubscription::batchMaxSize() const
+{
+    return d->m_batchMaxSize;
+}
+
+int QStompSubscription::batchMaxLinger() const
+{
+    return d->m_batchMaxLinger;
+}
+
+void QStompSubscription::setFlowControl(int minWindow, int maxWindow, const QString &prefetchHeader)
+{
+    d->m_minWindow = qMax(1, minWindow);
+    d->m_maxWindow = qMax(d->m_minWindow, maxWindow);
+    d->m_window = d->m_maxWindow;
+    d->m_flowControl = true;
+    if(!prefetchHeader.isEmpty())
+        d->m_subcribRequestFrame.setHeader(prefetchHeader, d->m_maxWindow);
+}
+
+bool QStompSubscription::hasFlowControl() const
+{
+    return d->m_flowControl;
+}
+
+int QStompSubscription::window() const
+{
+    return d->m_window;
+}
+
+int QStompSubscription::inFlight() const
+{
+    return d->m_unacked.size();
+}
+
+int QStompSubscription::lag() const
+{
+    return d->m_backlog.size();
+}
+
+void QStompSubscription::setAckCoalescing(int window, int maxDelayMs)
+{
+    d->m_ackWindow = qMax(0, window);
+    d->m_ackMaxDelay = qMax(0, maxDelayMs);
+}
+
+int QStompSubscription::ackCoalescingWindow() const
+{
+    return d->m_ackWindow;
+}
+
+int QStompSubscription::ackCoalescingMaxDelay() const
+{
+    return d->m_ackMaxDelay;
+}
+
+void QStompSubscription::setStreaming(qint64 threshold, QIODevice *device)
+{
+    d->m_streamThreshold = qMax<qint64>(0, threshold);
+    d->m_streamDevice = device;
+    d->m_streamHandler = StreamHandler();
+}
+
+void QStompSubscription::setStreaming(qint64 threshold, const StreamHandler &handler)
+{
+    d->m_streamThreshold = qMax<qint64>(0, threshold);
+    d->m_streamDevice = nullptr;
+    d->m_streamHandler = handler;
+}
+
+void QStompSubscription::resetStreaming()
+{
+    d->m_streamThreshold = 0;
+    d->m_streamDevice = nullptr;
+    d->m_streamHandler = StreamHandler();
+}
+
+qint64 QStompSubscription::streamingThreshold() const
+{
+    return d->m_streamThreshold;
+}
+
 bool QStompSubscription::isValid() const
 {
     return d->m_subcriber && d->m_slotMethod.isValid();
@@ -1295,34 +3483,259 @@ QStompRequestFrame QStompSubscription::subscriptionFrame() const
 void QStompSubscription::fireFrameMessage(QStompResponseFrame frame)
 {
     if(isValid()){
-        if(d->m_slotMethod.parameterType(0) == QMetaType::QVariantMap) {
+        if(d->m_batchDelivery) {
+            if(d->m_batch.isEmpty())
+                d->m_batchAge.start();
+            if(d->m_stats)
+                d->m_stats->m_heldFrameBytes.fetchAndAddRelaxed(qStompFrameBytes(frame));
+            d->m_batch.append(frame);
+            if(d->m_batchMaxSize > 0 && d->m_batch.size() >= d->m_batchMaxSize)
+                flushBatch();
+        }else if(d->m_slotMethod.parameterType(0) == QMetaType::QVariantMap) {
             QVariantMap headers = frame.header();
             headers["subscription"] = subscriptionFrame().header();
             QVariantMap msg = {
                 { "header", headers },
-                { "body", frame.body() }
+                { "body", frame.body() },
+                { "selfSent", frame.isSelfSent() }
             };
-            d->m_slotMethod.invoke(d->m_subcriber, Qt::QueuedConnection, Q_ARG(QVariantMap, msg));
+            qStompInvokeSlot(d.data(), "QVariantMap", msg, qStompFrameBytes(frame), frame.pd_func()->m_readStamp, frame.pd_func()->m_frameId);
         }else{
-            d->m_slotMethod.invoke(d->m_subcriber, Qt::QueuedConnection, Q_ARG(QStompResponseFrame, frame));
+            qStompInvokeSlot(d.data(), "QStompResponseFrame", frame, qStompFrameBytes(frame), frame.pd_func()->m_readStamp, frame.pd_func()->m_frameId);
         }
     }
 }
 
+void QStompSubscription::flushBatch()
+{
+    if(d->m_batch.isEmpty())
+        return;
+    QVector<QStompResponseFrame> batch;
+    batch.swap(d->m_batch);
+    qint64 bytes = 0;
+    for(const QStompResponseFrame &frame : batch)
+        bytes += qStompFrameBytes(frame);
+    if(d->m_stats)
+        d->m_stats->m_heldFrameBytes.fetchAndAddRelaxed(-bytes);
+    // a batch is timed and traced as its oldest frame
+    if(isValid())
+        qStompInvokeSlot(d.data(), "QVector<QStompResponseFrame>", batch, bytes,
+                         batch.first().pd_func()->m_readStamp, batch.first().pd_func()->m_frameId);
+}
+
 void QStompSubscription::assignMethodSlot(const char *subcriberSlot) {
     if(d->m_subcriber) {
         int methodIdx = d->m_subcriber->metaObject()->indexOfSlot(subcriberSlot);
         if(methodIdx != -1){
             QMetaMethod method = d->m_subcriber->metaObject()->method(methodIdx);
             if(method.parameterCount() == 1 &&
-                    (method.parameterType(0)==QMetaType::QVariantMap || method.parameterType(0) == qStompResponseFrameMetaTypeId)){
+                    (method.parameterType(0)==QMetaType::QVariantMap || method.parameterType(0) == qStompResponseFrameMetaTypeId ||
+                     method.parameterType(0) == qStompResponseFrameVectorMetaTypeId)){
                 d->m_slotMethod = method;
+                d->m_batchDelivery = method.parameterType(0) == qStompResponseFrameVectorMetaTypeId;
             }else{
-                qCritical() << "Filled slot method don't have good signature" << method.methodSignature() << endl
-                            << "That must be 'void slotMethod(QVariantMap)'";
+                qStompCritical(lcStompFrame) << "Filled slot method don't have good signature" << method.methodSignature() << endl
+                            << "That must be 'void slotMethod(QVariantMap)' or 'void slotMethod(QVector<QStompResponseFrame>)'";
             }
         }else{
-            qCritical() << "method " << subcriberSlot << "is not a slot";
+            qStompCritical(lcStompFrame) << "method " << subcriberSlot << "is not a slot";
         }
     }
 }
+
+
+QStompBatchPublisher::QStompBatchPublisher(QStompClient *client, QObject *parent) : QObject(parent), pd_ptr(new QStompBatchPublisherPrivate(this))
+{
+    P_D(QStompBatchPublisher);
+    d->m_client = client;
+    d->m_batchTimer.setSingleShot(true);
+    connect(&d->m_batchTimer, SIGNAL(timeout()), this, SLOT(commit()));
+    if(client)
+        connect(client, SIGNAL(frameConnectedReceived()), this, SLOT(_q_clientConnected()));
+}
+
+QStompBatchPublisher::~QStompBatchPublisher()
+{
+    P_D(QStompBatchPublisher);
+    // the open batch was never committed, do not leave its transaction open
+    if(!d->m_current.m_messages.isEmpty())
+        d->abortBatch(d->m_current);
+    delete this->pd_ptr;
+}
+
+QStompClient * QStompBatchPublisher::client() const
+{
+    const P_D(QStompBatchPublisher);
+    return d->m_client;
+}
+
+void QStompBatchPublisher::setMaxBatchSize(int messages)
+{
+    P_D(QStompBatchPublisher);
+    d->m_maxBatchSize = qMax(1, messages);
+}
+
+int QStompBatchPublisher::maxBatchSize() const
+{
+    const P_D(QStompBatchPublisher);
+    return d->m_maxBatchSize;
+}
+
+void QStompBatchPublisher::setMaxBatchDelay(int msecs)
+{
+    P_D(QStompBatchPublisher);
+    d->m_maxBatchDelay = qMax(0, msecs);
+}
+
+int QStompBatchPublisher::maxBatchDelay() const
+{
+    const P_D(QStompBatchPublisher);
+    return d->m_maxBatchDelay;
+}
+
+void QStompBatchPublisher::setMaxRetries(int retries)
+{
+    P_D(QStompBatchPublisher);
+    d->m_maxRetries = qMax(0, retries);
+}
+
+int QStompBatchPublisher::maxRetries() const
+{
+    const P_D(QStompBatchPublisher);
+    return d->m_maxRetries;
+}
+
+void QStompBatchPublisher::send(const QString &destination, const QString &body, const QVariantMap &headers)
+{
+    P_D(QStompBatchPublisher);
+    if(d->m_client.isNull())
+        return;
+
+    if(d->m_current.m_messages.isEmpty()){
+        d->m_current.m_age.start();
+        d->beginBatch(d->m_current);
+        d->m_batchTimer.start(d->m_maxBatchDelay);
+    }
+
+    QStompRequestFrame frame(Stomp::RequestSend);
+    frame.setHeader(headers);
+    frame.setContentEncoding(d->m_client->contentEncoding());
+    frame.setDestination(destination);
+    frame.setBody(body);
+    frame.setTransactionId(d->m_current.m_transactionId);
+    d->m_client->sendFrame(frame);
+    d->m_current.m_messages << frame;
+
+    if(d->m_current.m_messages.size() >= d->m_maxBatchSize)
+        commit();
+}
+
+int QStompBatchPublisher::pendingMessages() const
+{
+    const P_D(QStompBatchPublisher);
+    return d->m_current.m_messages.size();
+}
+
+int QStompBatchPublisher::committingBatches() const
+{
+    const P_D(QStompBatchPublisher);
+    return d->m_committing.size();
+}
+
+void QStompBatchPublisher::commit()
+{
+    P_D(QStompBatchPublisher);
+    d->m_batchTimer.stop();
+    if(d->m_current.m_messages.isEmpty() || d->m_client.isNull())
+        return;
+    d->commitBatch(d->m_current);
+    d->m_current = QStompPublisherBatch();
+}
+
+QString QStompBatchPublisherPrivate::nextTransactionId()
+{
+    P_Q(QStompBatchPublisher);
+    return QString("batch-%1-%2").arg(quintptr(q), 0, 16).arg(++this->m_counter);
+}
+
+void QStompBatchPublisherPrivate::beginBatch(QStompPublisherBatch &batch)
+{
+    batch.m_transactionId = this->nextTransactionId();
+    batch.m_connection = this->m_connections;
+    this->m_client->begin(batch.m_transactionId);
+}
+
+// Only on the connection that began it, the broker drops it with the connection
+void QStompBatchPublisherPrivate::abortBatch(const QStompPublisherBatch &batch)
+{
+    if(!this->m_client.isNull() && this->m_client->isConnected() && batch.m_connection == this->m_connections)
+        this->m_client->abort(batch.m_transactionId);
+}
+
+void QStompBatchPublisherPrivate::_q_clientConnected()
+{
+    // the open batch lost its transaction with the old connection, nothing of
+    // it was committed, so it starts over in a new one
+    this->m_connections++;
+    if(this->m_current.m_messages.isEmpty() || this->m_client.isNull())
+        return;
+    this->beginBatch(this->m_current);
+    for(QStompRequestFrame &frame : this->m_current.m_messages){
+        frame.setTransactionId(this->m_current.m_transactionId);
+        this->m_client->sendFrame(frame);
+    }
+}
+
+void QStompBatchPublisherPrivate::commitBatch(const QStompPublisherBatch &batch)
+{
+    P_Q(QStompBatchPublisher);
+    QStompRequestFrame frame(Stomp::RequestCommit);
+    frame.setTransactionId(batch.m_transactionId);
+
+    QFutureWatcher<QStompResponseFrame> *watcher = new QFutureWatcher<QStompResponseFrame>(q);
+    this->m_committing.insert(watcher, batch);
+    QObject::connect(watcher, SIGNAL(finished()), q, SLOT(_q_commitFinished()));
+    watcher->setFuture(this->m_client->sendFrameWithReceipt(std::move(frame)));
+}
+
+void QStompBatchPublisherPrivate::_q_commitFinished()
+{
+    P_Q(QStompBatchPublisher);
+    QFutureWatcher<QStompResponseFrame> *watcher = static_cast<QFutureWatcher<QStompResponseFrame>*>(q->sender());
+    if(!this->m_committing.contains(watcher))
+        return;
+    QStompPublisherBatch batch = this->m_committing.take(watcher);
+    QFuture<QStompResponseFrame> future = watcher->future();
+    watcher->deleteLater();
+
+    if(future.isCanceled() || future.resultCount() == 0){
+        // No answer in time or the connection dropped, the broker may have
+        // committed the batch already, so replaying it could duplicate it
+        qStompWarning(lcStompFrame) << "Transaction" << batch.m_transactionId << "timed out, outcome unknown";
+        // rolls it back if the COMMIT has not been applied yet
+        this->abortBatch(batch);
+        emit q->batchFailed(batch.m_messages.size(), QStompResponseFrame());
+        return;
+    }
+
+    QStompResponseFrame reply = future.result();
+    if(reply.type() == Stomp::ResponseReceipt){
+        emit q->batchCommitted(batch.m_messages.size(), batch.m_age.elapsed());
+        return;
+    }
+
+    // The broker rejected the commit, the transaction is gone and safe to replay
+    if(this->m_client.isNull() || !this->m_client->isConnected() || batch.m_attempts > this->m_maxRetries){
+        qStompWarning(lcStompFrame) << "Transaction" << batch.m_transactionId << "failed after" << batch.m_attempts << "attempt(s)";
+        emit q->batchFailed(batch.m_messages.size(), reply);
+        return;
+    }
+
+    batch.m_attempts++;
+    this->beginBatch(batch);
+    for(QStompRequestFrame &frame : batch.m_messages){
+        frame.setTransactionId(batch.m_transactionId);
+        this->m_client->sendFrame(frame);
+    }
+    this->commitBatch(batch);
+}
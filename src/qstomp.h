@@ -26,11 +26,15 @@
 #include <QtCore/QObject>
 #include <QtCore/QString>
 #include <QtCore/QMap>
+#include <QtCore/QVector>
+#include <QtCore/QFuture>
+#include <functional>
 #include <QtNetwork/QAbstractSocket>
 #include <QPointer>
 #include <QExplicitlySharedDataPointer>
 
 class QTcpSocket;
+class QIODevice;
 class QAuthenticator;
 class QTextCodec;
 
@@ -40,6 +44,8 @@ class QStompRequestFramePrivate;
 class QStompSubScriptionData;
 class QStompClientPrivate;
 class QStompClient;
+class QStompBatchPublisherPrivate;
+class QStompSelfSentMatcher;
 
 
 namespace Stomp {
@@ -74,6 +80,15 @@ namespace Stomp {
     };
     const QList<QString> AckTypeList = {"auto", "client", "client-individual"};
 
+    enum TracePoint {
+        TraceSocketRead,
+        TraceFrameComplete,
+        TraceRouted,
+        TraceDispatchQueued,
+        TraceSlotEntry,
+        TraceSlotExit
+    };
+
     enum Protocol{
         ProtocolInvalid = -1,
         ProtocolStomp_1_2,
@@ -96,6 +111,8 @@ namespace Stomp {
     const QString HeaderContentType("content-type");
     const QString HeaderContentLength("content-length");
     const QString HeaderContentEncoding("content-encoding");
+    const QString HeaderContentCompression("x-qstomp-compression");
+    const QByteArray CompressionZlib("zlib");
 
     const QString HeaderResponseDestination("destination");
     const QString HeaderResponseMessageID("message-id");
@@ -113,6 +130,11 @@ namespace Stomp {
 
     const QByteArray PingContent(1, 0x0A);
     const QByteArray EndFrame = QByteArray().append('\0').append('\n');
+
+    // Capture files start with CaptureMagic, followed by one record per socket
+    // read: quint64 ns since the capture started and quint32 length, both
+    // little endian, then the bytes read
+    const QByteArray CaptureMagic("QSTCAP01");
 }
 
 class QSTOMP_SHARED_EXPORT QStompFrame
@@ -122,9 +144,11 @@ public:
     virtual ~QStompFrame();
 
     QStompFrame &operator=(const QStompFrame &other);
+    QStompFrame &operator=(QStompFrame &&other);
 
     void setHeader(const QString &key, const QVariant &value);
     void setHeader(const QVariantMap &values);
+    void setHeader(QVariantMap &&values);
     QVariantMap header() const;
     bool headerHasKey(const QString &key) const;
     QList<QString> headerKeys() const;
@@ -151,6 +175,7 @@ public:
 
     void setBody(const QString &body);
     void setRawBody(const QByteArray &body);
+    void setRawBody(QByteArray &&body);
 
 protected:
     virtual bool parseHeaderLine(const QByteArray &line, int number);
@@ -160,6 +185,7 @@ protected:
 protected:
     QStompFrame(QStompFramePrivate * d);
     QStompFrame(const QStompFrame &other, QStompFramePrivate * d);
+    QStompFrame(QStompFrame &&other, QStompFramePrivate * d);
 
     QStompFramePrivate * const pd_ptr;
 };
@@ -170,9 +196,11 @@ class QSTOMP_SHARED_EXPORT QStompResponseFrame : public QStompFrame
 public:
     QStompResponseFrame();
     QStompResponseFrame(const QStompResponseFrame &other);
+    QStompResponseFrame(QStompResponseFrame &&other);
     QStompResponseFrame(const QByteArray &frame);
     QStompResponseFrame(Stomp::ResponseCommand type);
     QStompResponseFrame &operator=(const QStompResponseFrame &other);
+    QStompResponseFrame &operator=(QStompResponseFrame &&other);
 
     void setType(Stomp::ResponseCommand type);
     Stomp::ResponseCommand type() const;
@@ -202,7 +230,12 @@ public:
     QByteArray toByteArray() const;
 
 protected:
+    QStompResponseFrame(const QByteArray &frame, const QStompSelfSentMatcher *matcher, int maxInflatedSize);
     bool parseHeaderLine(const QByteArray &line, int number);
+
+    friend class QStompClient;
+    friend class QStompClientPrivate;
+    friend class QStompSubscription;
 };
 
 Q_DECLARE_METATYPE(QStompResponseFrame)
@@ -214,9 +247,11 @@ public:
 
     QStompRequestFrame();
     QStompRequestFrame(const QStompRequestFrame &other);
+    QStompRequestFrame(QStompRequestFrame &&other);
     QStompRequestFrame(const QByteArray &frame);
     QStompRequestFrame(Stomp::RequestCommand type);
     QStompRequestFrame &operator=(const QStompRequestFrame &other);
+    QStompRequestFrame &operator=(QStompRequestFrame &&other);
 
     void setType(Stomp::RequestCommand type);
     Stomp::RequestCommand type() const;
@@ -269,6 +304,42 @@ public:
     void setGoodByeMessage(const QString &body, const QVariantMap &headers = QVariantMap());
     void resetGoodByeMessage();
 
+    // only used when the slot takes a QVector<QStompResponseFrame>
+    void setBatchDelivery(int maxBatchSize, int maxLingerMs = 0);
+    bool isBatchDelivery() const;
+    int batchMaxSize() const;
+    int batchMaxLinger() const;
+
+    // client side window of unacked deliveries (ack client / client-individual),
+    // adapted to the consumer ack rate; maxWindow is also sent as broker prefetch.
+    // The window does not throttle the broker: it keeps up to maxWindow messages
+    // unacked and whatever exceeds window() waits locally (lag()), so memory is
+    // bounded by the prefetch only. Brokers ignoring prefetchHeader are unbounded
+    void setFlowControl(int minWindow, int maxWindow, const QString &prefetchHeader = "activemq.prefetchSize");
+    bool hasFlowControl() const;
+    int window() const;
+    int inFlight() const;
+    int lag() const;
+
+    // QStompClient::ack() on this subscription's messages is deferred and sent
+    // as one cumulative ACK (client) or one coalesced write (client-individual)
+    // once 'window' acks are pending or the oldest is maxDelayMs old
+    void setAckCoalescing(int window, int maxDelayMs = 100);
+    int ackCoalescingWindow() const;
+    int ackCoalescingMaxDelay() const;
+
+    // MESSAGE bodies with a content-length of at least 'threshold' bytes are not
+    // buffered but passed on while they arrive, in chunks of at most
+    // QStompClient::streamingChunkSize(); the slot then receives the frame
+    // without its body once the message is complete. The body is passed on
+    // before duplicate suppression and flow control see the frame, so a
+    // redelivered message is streamed again and the window does not hold it
+    typedef std::function<void(const QStompResponseFrame &header, const QByteArray &chunk, bool last)> StreamHandler;
+    void setStreaming(qint64 threshold, QIODevice *device);
+    void setStreaming(qint64 threshold, const StreamHandler &handler);
+    void resetStreaming();
+    qint64 streamingThreshold() const;
+
     bool isValid() const;
 
     QStompRequestFrame subscriptionFrame() const;
@@ -276,12 +347,89 @@ public:
 protected:
     QStompSubscription(QObject *subcriber, const QString &destination, const QVariantMap &headers = QVariantMap());
     void fireFrameMessage(QStompResponseFrame);
+    void flushBatch();
     void assignMethodSlot(const char * subcriberSlot);
 
 protected:
     QExplicitlySharedDataPointer<QStompSubScriptionData> d;
 
     friend class QStompClient;
+    friend class QStompClientPrivate;
+};
+
+// Snapshot of a log-linear latency histogram, values in nanoseconds with
+// about 6% resolution up to about 68 seconds; longer values share the last
+// bucket, max() stays exact
+class QSTOMP_SHARED_EXPORT QStompHistogram
+{
+public:
+    QStompHistogram();
+
+    bool isEmpty() const;
+    quint64 count() const;
+    qint64 max() const;
+    double mean() const;
+    qint64 percentile(double p) const;
+
+    // for callers keeping their own, e.g. per consumer latencies
+    void record(qint64 value);
+    void merge(const QStompHistogram &other);
+
+    static int bucketOf(quint64 value);
+    static qint64 bucketValue(int bucket);
+    static const int BucketCount = 528;
+
+private:
+    QVector<quint64> m_buckets;
+    quint64 m_count;
+    quint64 m_sum;
+    qint64 m_max;
+
+    friend class QStompStatisticsData;
+};
+
+class QSTOMP_SHARED_EXPORT QStompClientStatistics
+{
+public:
+    QStompClientStatistics();
+
+    quint64 framesReceived;
+    quint64 framesSent;
+    quint64 messagesReceived;
+    quint64 bytesReceived;
+    quint64 bytesSent;
+    quint64 parseErrors;
+    quint64 resyncs;
+    quint64 heartBeatMisses;
+    quint64 receiptTimeouts;
+    quint64 duplicatesDropped;
+
+    quint64 readPauses;
+
+    qint64 receiveBufferBytes;
+    qint64 sendQueueBytes; // written but not yet handed to the kernel, not limited
+    qint64 pendingDispatches;
+    qint64 pendingDispatchBytes; // frames held by queued slot calls
+    qint64 heldFrameBytes; // frames waiting in batches and flow control backlogs
+    qint64 pendingReceipts;
+    // inbound bytes, what QStompClient::setMemoryLimit() is checked against
+    qint64 memoryInUse() const;
+
+    QStompHistogram parseTime;
+    QStompHistogram dispatchLatency; // socket read to slot entry
+    QStompHistogram receiptRoundTrip;
+
+    // Prometheus text exposition format; labels are added verbatim, e.g. client="orders"
+    QByteArray toPrometheus(const QString &prefix = "qstomp", const QString &labels = QString()) const;
+};
+
+class QSTOMP_SHARED_EXPORT QStompTraceEvent
+{
+public:
+    Stomp::TracePoint point;
+    qint64 timestamp; // ns on the monotonic clock (CLOCK_MONOTONIC on Linux)
+    quint64 frameId; // per client, 0 for socket reads
+    qint64 bytes;
 };
 
 class QSTOMP_SHARED_EXPORT QStompClient : public QObject
@@ -306,11 +454,76 @@ public:
     QTcpSocket * socket() const;
 
     void sendFrame(const QStompRequestFrame &frame);
+    // a SEND body due for compression is compressed in place instead of in a copy
+    void sendFrame(QStompRequestFrame &&frame);
+    // The future gets the RECEIPT (or the ERROR carrying the receipt-id) and is
+    // canceled on timeout or disconnect; timeout < 0 uses receiptTimeout(). The
+    // timeout starts once the frame is written, not while it waits for a free
+    // slot (see setMaxPendingReceipts())
+    QFuture<QStompResponseFrame> sendFrameWithReceipt(const QStompRequestFrame &frame, int timeout = -1);
+    QFuture<QStompResponseFrame> sendFrameWithReceipt(QStompRequestFrame &&frame, int timeout = -1);
 
     void setLogin(const QString &user = QString(), const QString &password = QString());
+    // frames whose headerKey (any case) carries our session are flagged, see
+    // QStompResponseFrame::isSelfSent() and "selfSent" in QVariantMap slots
     void setSelfSentFeature(bool b, const QString& headerKey = "sender");
     void setVirtualHost(const QString &host = QString("/"));
     void setHeartBeat(const int &outgoing = 0, const int &incoming = 0);
+    // drive heart-beats from one coarse timer wheel shared by all clients of the thread
+    // instead of two QTimers per client; applies from the next CONNECTED frame
+    void setSharedHeartBeatTimer(bool enable);
+    bool sharedHeartBeatTimer() const;
+    // SEND frames (outside transactions) issued while not connected are kept in
+    // memory-mapped segment files under directory and replayed after CONNECTED;
+    // an empty directory disables the outbox. Frames are only dropped when the
+    // outbox is full while disconnected; connected, they wait in memory until
+    // the replay has made room
+    bool setOutbox(const QString &directory, qint64 maxBytes = 64*1024*1024);
+    QString outboxDirectory() const;
+    qint64 outboxSize() const;
+    // drop MESSAGE frames whose key header was seen among the last 'capacity'
+    // processed messages (redeliveries after a reconnect); 0 disables. With
+    // client acks a message counts as processed once acked, with auto acks once
+    // handed to its subscription. Nacked messages are delivered again.
+    void setDuplicateSuppression(int capacity, const QString &headerKey = Stomp::HeaderResponseMessageID);
+    int duplicateSuppressionCapacity() const;
+    qint64 duplicatesDropped() const;
+    qint64 duplicateSuppressionMemory() const;
+    // keys are kept as 64 bit fingerprints, so the odds of a new message being
+    // taken for a duplicate are capacity / 2^64; the capacity is the only knob,
+    // narrower fingerprints would save little and drop real messages
+    double duplicateFalsePositiveRate() const;
+    // SEND bodies of at least 'threshold' bytes are zlib compressed (qCompress) and
+    // flagged with Stomp::HeaderContentCompression; receivers inflate them transparently
+    void setBodyCompression(bool enable, int threshold = 1024, int level = -1);
+    bool bodyCompression() const;
+    int bodyCompressionThreshold() const;
+    void setStreamingChunkSize(int bytes);
+    int streamingChunkSize() const;
+    // the connection is closed when a frame that is not streamed would exceed
+    // this size, compressed bodies may not inflate beyond it; 0 means no limit
+    void setMaxFrameSize(int bytes);
+    int maxFrameSize() const;
+    // reading from the socket pauses while received, buffered and undelivered
+    // frames exceed this many bytes, until consumers caught up; 0 means no
+    // limit. Outgoing data is not counted, a client that stops reading because
+    // its writes back up could deadlock with the broker
+    void setMemoryLimit(qint64 bytes);
+    qint64 memoryLimit() const;
+    bool isReadingPaused() const;
+    // safe to call from any thread
+    QStompClientStatistics statistics() const;
+    // Called at every pipeline stage of every frame; slot entry and exit are
+    // reported from the subscriber's thread. Set it before connecting, an
+    // empty handler disables tracing
+    typedef std::function<void(const QStompTraceEvent &event)> TraceHandler;
+    void setTraceHandler(const TraceHandler &handler);
+    bool isTracing() const;
+    // record the received byte stream to fileName, an empty name stops
+    bool setCaptureFile(const QString &fileName);
+    QString captureFile() const;
+    // decode data as if it was read from the socket, e.g. to replay a capture
+    void injectReceivedData(const QByteArray &data);
 
     QStompSubscription createSubscription(QObject *subcriber, const char *subcriberSlot, const QString &destination, const QString &ack = "auto", const QVariantMap &headers = QVariantMap()) const;
     void registerSubscription(QStompSubscription &);
@@ -321,12 +534,15 @@ public:
 
     void logout();
     void send(const QString &destination, const QString &body, const QString &transactionId = QString(), const QVariantMap &headers = QVariantMap());
+    void send(const QString &destination, const QString &body, const QString &transactionId, QVariantMap &&headers);
+    QFuture<QStompResponseFrame> sendWithReceipt(const QString &destination, const QString &body, const QString &transactionId = QString(), const QVariantMap &headers = QVariantMap(), int timeout = -1);
     void commit(const QString &transactionId, const QVariantMap &headers = QVariantMap());
     void begin(const QString &transactionId, const QVariantMap &headers = QVariantMap());
     void abort(const QString &transactionId, const QVariantMap &headers = QVariantMap());
     void ack(const QString &messageId, const QString &transactionId = QString(), const QVariantMap &headers = QVariantMap());
     // not available for stomp v1.0
     void nack(const QString &messageId, const QString &transactionId = QString(), const QVariantMap &headers = QVariantMap());
+    void flushAcks();
 
     bool isConnected() const;
     QString getConnectedStompVersion() const;
@@ -341,6 +557,13 @@ public:
     QAbstractSocket::SocketError socketError() const;
     QString socketErrorString() const;
 
+    void setReceiptTimeout(int msecs);
+    int receiptTimeout() const;
+    // further confirmed frames wait locally until a receipt comes back, 0 means no limit
+    void setMaxPendingReceipts(int max);
+    int maxPendingReceipts() const;
+    int pendingReceipts() const;
+
     QByteArray contentEncoding();
     void setContentEncoding(const QByteArray & name);
     void setContentEncoding(const QTextCodec * codec);
@@ -377,6 +600,53 @@ private:
     Q_PRIVATE_SLOT(pd_func(), void _q_socketReadyRead())
     Q_PRIVATE_SLOT(pd_func(), void _q_sendPing())
     Q_PRIVATE_SLOT(pd_func(), void _q_checkPong())
+    Q_PRIVATE_SLOT(pd_func(), void _q_flushBatches())
+    Q_PRIVATE_SLOT(pd_func(), void _q_flushAcks())
+    Q_PRIVATE_SLOT(pd_func(), void _q_checkReceipts())
+    Q_PRIVATE_SLOT(pd_func(), void _q_checkMemory())
+    Q_PRIVATE_SLOT(pd_func(), void _q_socketBytesWritten())
+};
+
+class QSTOMP_SHARED_EXPORT QStompBatchPublisher : public QObject
+{
+    Q_OBJECT
+    P_DECLARE_PRIVATE(QStompBatchPublisher)
+public:
+    explicit QStompBatchPublisher(QStompClient *client, QObject *parent = nullptr);
+    virtual ~QStompBatchPublisher();
+
+    QStompClient * client() const;
+
+    void setMaxBatchSize(int messages);
+    int maxBatchSize() const;
+    void setMaxBatchDelay(int msecs);
+    int maxBatchDelay() const;
+    // batches whose COMMIT the broker answers with an ERROR are replayed this often
+    void setMaxRetries(int retries);
+    int maxRetries() const;
+
+    // the open batch moves to a new transaction when the client reconnects and
+    // is aborted when the publisher is destroyed before commit()
+    void send(const QString &destination, const QString &body, const QVariantMap &headers = QVariantMap());
+    int pendingMessages() const;
+    int committingBatches() const;
+
+public Q_SLOTS:
+    void commit();
+
+Q_SIGNALS:
+    // latency runs from the first message of the batch to the commit receipt
+    void batchCommitted(int messages, qint64 latency);
+    // error is the broker's ERROR once the retries are used up, or an invalid
+    // frame (Stomp::ResponseInvalid) when the commit receipt did not arrive in
+    // time; the batch may have been committed then, an ABORT is sent in case it
+    // was not, and it is not replayed
+    void batchFailed(int messages, QStompResponseFrame error);
+
+private:
+    QStompBatchPublisherPrivate * const pd_ptr;
+    Q_PRIVATE_SLOT(pd_func(), void _q_commitFinished())
+    Q_PRIVATE_SLOT(pd_func(), void _q_clientConnected())
 };
 
 // Include private header so MOC won't complain
@@ -25,21 +25,102 @@
 #include <QtCore/QTimer>
 #include <QtCore/QSharedData>
 #include <QtCore/QMetaMethod>
-#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QQueue>
+#include <QtCore/QFutureInterface>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QBasicTimer>
+#include <QtCore/QFile>
+#include <QtCore/QIODevice>
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QMutex>
+#include <QtCore/QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(lcStompIo)
+Q_DECLARE_LOGGING_CATEGORY(lcStompFrame)
+Q_DECLARE_LOGGING_CATEGORY(lcStompHeartBeat)
+
+// Arguments are only evaluated when the category is enabled for the level.
+// QSTOMP_NO_LOGGING compiles debug output out entirely; warnings stay.
+#if defined(QSTOMP_NO_LOGGING)
+#  define qStompDebug(category) QT_NO_QDEBUG_MACRO()
+#else
+#  define qStompDebug(category) qCDebug(category)
+#endif
+#define qStompWarning(category) qCWarning(category)
+#define qStompCritical(category) qCCritical(category)
+
+// Tracepoints cost a branch on the handler when unused. QSTOMP_USDT adds
+// SystemTap SDT probes (provider qstomp) for perf, bpftrace and LTTng;
+// QSTOMP_NO_TRACING removes both.
+#if defined(QSTOMP_USDT)
+#  include <sys/sdt.h>
+#  define QSTOMP_USDT_PROBE(probe, frameId, bytes) DTRACE_PROBE2(qstomp, probe, frameId, bytes)
+#else
+#  define QSTOMP_USDT_PROBE(probe, frameId, bytes) do { } while (0)
+#endif
+#if defined(QSTOMP_NO_TRACING)
+#  define QSTOMP_TRACE(stats, point, probe, frameId, bytes) do { } while (0)
+#else
+#  define QSTOMP_TRACE(stats, point, probe, frameId, bytes) \
+    do { \
+        QSTOMP_USDT_PROBE(probe, frameId, bytes); \
+        if (Q_UNLIKELY((stats)->m_traceHandler)) \
+            (stats)->trace(Stomp::point, frameId, bytes); \
+    } while (0)
+#endif
 
 class QStompFramePrivate
 {
 public:
+    virtual ~QStompFramePrivate() { }
+    static void *operator new(size_t size);
+    static void operator delete(void *block, size_t size);
     QVariantMap m_header;
     bool m_valid;
     QByteArray m_body;
-    const QTextCodec * m_textCodec;
+    const QTextCodec * m_textCodec; // nullptr means UTF-8, decoded without a codec
+    mutable QString m_decodedBody;
+    mutable bool m_bodyDecoded;
+    int m_maxInflatedSize; // for compressed bodies while parsing, 0 means no limit
+};
+
+// Per-thread free list for frame privates. Blocks fit either private, so
+// request and response frames share it; a frame released on another thread
+// than the one it was allocated on ends up in that thread's list.
+class QStompFramePool
+{
+public:
+    QStompFramePool() : m_free(nullptr), m_count(0) { }
+    ~QStompFramePool();
+    static void *allocate(size_t size);
+    static void release(void *block, size_t size);
+
+private:
+    struct Block { Block *m_next; };
+    static QStompFramePool *local(bool create);
+    Block *m_free;
+    int m_count;
+};
+
+class QStompSelfSentMatcher
+{
+public:
+    QByteArray m_keyPrefix; // lower case "<key>:"
+    QByteArray m_session;
 };
 
 class QStompResponseFramePrivate : public QStompFramePrivate
 {
 public:
+    QStompResponseFramePrivate() : m_type(Stomp::ResponseInvalid), m_selfSent(false), m_matcher(nullptr), m_readStamp(0), m_frameId(0) { }
     Stomp::ResponseCommand m_type;
+    bool m_selfSent;
+    const QStompSelfSentMatcher *m_matcher; // only set while parsing
+    qint64 m_readStamp; // socket read that completed the frame, ns on the statistics clock
+    quint64 m_frameId; // trace id, 0 if not received
 };
 
 class QStompRequestFramePrivate : public QStompFramePrivate
@@ -48,14 +129,278 @@ public:
     Stomp::RequestCommand m_type;
 };
 
+class QStompHistogramData
+{
+public:
+    QStompHistogramData() : m_buckets(nullptr) {}
+    ~QStompHistogramData() { delete[] this->m_buckets.load(); }
+    void record(qint64 value);
+    QAtomicPointer<QAtomicInteger<quint64> > m_buckets; // allocated by the first record()
+    QAtomicInteger<quint64> m_count;
+    QAtomicInteger<quint64> m_sum;
+    QAtomicInteger<qint64> m_max;
+
+private:
+    Q_DISABLE_COPY(QStompHistogramData)
+};
+
+// Shared with queued slot calls, which may outlive the client
+class QStompStatisticsData
+{
+public:
+    QStompStatisticsData() : m_readStamp(0), m_frameId(0), m_client(nullptr) { m_clock.start(); }
+    qint64 now() const { return m_clock.nsecsElapsed(); }
+    void snapshot(QStompClientStatistics *stats) const;
+    static void snapshot(const QStompHistogramData &data, QStompHistogram *histogram);
+    void trace(Stomp::TracePoint point, quint64 frameId, qint64 bytes) const;
+    void dispatchFinished(qint64 bytes);
+    void requestMemoryCheck();
+
+    QElapsedTimer m_clock;
+    QAtomicInteger<quint64> m_framesReceived, m_framesSent, m_messagesReceived;
+    QAtomicInteger<quint64> m_bytesReceived, m_bytesSent;
+    QAtomicInteger<quint64> m_parseErrors, m_resyncs, m_heartBeatMisses, m_receiptTimeouts, m_duplicates;
+    QAtomicInteger<qint64> m_receiveBufferBytes, m_pendingDispatches, m_pendingReceipts;
+    QAtomicInteger<qint64> m_sendQueueBytes, m_pendingDispatchBytes, m_heldFrameBytes;
+    QAtomicInteger<quint64> m_readPauses;
+    QStompHistogramData m_parseTime, m_dispatchLatency, m_receiptRoundTrip;
+    qint64 m_readStamp; // last socket read, client thread only; frames keep their own
+    quint64 m_frameId; // last id handed out, client thread only
+    QStompClient::TraceHandler m_traceHandler;
+
+    // Lets queued slot calls, from any thread, wake a client paused for its
+    // memory limit; at most one check is queued at a time
+    QAtomicInt m_readPaused, m_memoryCheckQueued;
+    QMutex m_clientLock;
+    QObject *m_client; // cleared when the client goes away
+};
+
+// Alive from queueing a slot call until it ran or was dropped with its receiver
+class QStompDispatchTicket
+{
+public:
+    QStompDispatchTicket(const QSharedPointer<QStompStatisticsData> &stats, qint64 bytes, qint64 readStamp, quint64 frameId) : m_stats(stats),
+        m_readStamp(readStamp), m_frameId(frameId), m_bytes(bytes)
+    { m_stats->m_pendingDispatches.ref(); m_stats->m_pendingDispatchBytes.fetchAndAddRelaxed(bytes); }
+    ~QStompDispatchTicket() { m_stats->dispatchFinished(m_bytes); }
+    QSharedPointer<QStompStatisticsData> m_stats;
+    qint64 m_readStamp;
+    quint64 m_frameId;
+    qint64 m_bytes; // frames held by the queued call
+};
+
+// Message ids delivered and not acked yet, in delivery order. Acks look
+// an id up by hash and cut the ordered part from the front or at one key
+class QStompInFlight
+{
+public:
+    QStompInFlight() : m_sequence(0) { }
+    void append(const QString &messageId);
+    bool remove(const QString &messageId);
+    // removes messageId and everything delivered before it
+    QList<QString> takeUpTo(const QString &messageId);
+    QList<QString> ids() const { return m_order.values(); }
+    int size() const { return m_sequences.size(); }
+    void clear() { m_sequences.clear(); m_order.clear(); }
+
+private:
+    QHash<QString, quint64> m_sequences;
+    QMap<quint64, QString> m_order;
+    quint64 m_sequence;
+};
+
 class QStompSubScriptionData : public QSharedData
 {
 public:
+    QStompSubScriptionData() : m_ackType(Stomp::AckAuto), m_batchDelivery(false), m_batchMaxSize(1000), m_batchMaxLinger(0), m_batchQueued(false),
+        m_flowControl(false), m_window(0), m_minWindow(0), m_maxWindow(0), m_ackRate(0), m_ackedInPeriod(0),
+        m_ackWindow(0), m_ackMaxDelay(100), m_pendingAckCount(0), m_streamThreshold(0) { }
     QPointer<QObject> m_subcriber;
     QMetaMethod m_slotMethod;
     QStompRequestFrame m_subcribRequestFrame;
     QStompRequestFrame m_welcomeMessage;
     QStompRequestFrame m_goodbyeMessage;
+    Stomp::AckType m_ackType;
+
+    bool m_batchDelivery; // slot takes QVector<QStompResponseFrame>
+    int m_batchMaxSize; // 0 means no limit
+    int m_batchMaxLinger; // ms to wait for more frames after a read cycle
+    QVector<QStompResponseFrame> m_batch;
+    bool m_batchQueued; // listed in QStompClientPrivate::m_pendingBatches
+    QElapsedTimer m_batchAge;
+
+    bool m_flowControl;
+    int m_window, m_minWindow, m_maxWindow;
+    QStompInFlight m_unacked;
+    QQueue<QStompResponseFrame> m_backlog; // received while the window was full
+    double m_ackRate; // acks per second (EWMA)
+    int m_ackedInPeriod;
+    QElapsedTimer m_rateClock;
+
+    int m_ackWindow; // 0 means acks are written right away
+    int m_ackMaxDelay;
+    QList<QString> m_pendingAcks; // only the latest one for cumulative acks
+    int m_pendingAckCount;
+
+    qint64 m_streamThreshold; // 0 means never stream
+    QPointer<QIODevice> m_streamDevice;
+    QStompSubscription::StreamHandler m_streamHandler;
+
+    QSharedPointer<QStompStatisticsData> m_stats; // of the client it is registered with
+};
+
+class QStompFrameScan
+{
+public:
+    QStompFrameScan() { reset(); }
+    void reset() { m_offset = 0; m_headerEnd = -1; m_frameLength = -1; m_streamChecked = false; }
+    int m_offset; // where the next search resumes
+    int m_headerEnd; // position of the blank line, -1 until found
+    qint64 m_frameLength; // from content-length, without the NUL, -1 if unknown
+    bool m_streamChecked;
+};
+
+class QStompStreamState
+{
+public:
+    QStompStreamState() : m_remaining(0) { }
+    bool isActive() const { return bool(m_sub); }
+    QExplicitlySharedDataPointer<QStompSubScriptionData> m_sub;
+    QStompResponseFrame m_header;
+    qint64 m_remaining; // body bytes still expected, the NUL terminator follows
+};
+
+class QStompPendingReceipt
+{
+public:
+    QStompPendingReceipt() : m_timeout(0), m_deadline(-1), m_sentAt(0), m_written(false) { }
+    QFutureInterface<QStompResponseFrame> m_promise;
+    int m_timeout; // ms, counted from the write, 0 without timeout
+    qint64 m_deadline; // on m_clock, -1 until written or without timeout
+    qint64 m_sentAt; // ns on the statistics clock
+    bool m_written;
+};
+
+// Append-only store of serialized frames, split in fixed size mapped segments.
+// A record is a little endian quint32 length followed by the frame bytes;
+// a zero length marks the end of the used part of a segment. Records written
+// to the socket get the top bit of their length set, which is the persisted
+// replay cursor; fully consumed segments are removed.
+class QStompOutbox
+{
+public:
+    QStompOutbox(const QString &directory, qint64 maxBytes);
+    ~QStompOutbox();
+
+    bool open();
+    bool append(const QByteArray &serialized);
+    bool isEmpty() const;
+    qint64 size() const;
+    QString directory() const;
+    // next records after the ones already read, up to chunkSize bytes unless
+    // a single record is larger; their sizes are appended to 'records'
+    QByteArray read(int chunkSize, QVector<int> *records);
+    // marks the oldest 'records' read records as sent
+    void commit(int records);
+    // forgets what was read but not committed
+    void rewind();
+
+private:
+    struct Segment {
+        QFile *file;
+        uchar *map;
+        qint64 capacity;
+        qint64 used;
+        qint64 consumed; // leading records already sent
+    };
+    Segment *addSegment(qint64 capacity);
+    void closeSegment(Segment *segment, bool remove);
+    void dropConsumed();
+
+    QString m_directory;
+    qint64 m_maxBytes;
+    qint64 m_segmentSize;
+    qint64 m_diskUsage;
+    qint64 m_pending;
+    int m_nextIndex;
+    QList<Segment*> m_segments;
+    int m_readSegment; // read cursor, ahead of the committed one
+    qint64 m_readPos;
+};
+
+// Bounded set of 64 bit key fingerprints: an open addressing table with
+// linear probing, plus an insertion order ring that evicts the oldest key
+class QStompDedupCache
+{
+public:
+    explicit QStompDedupCache(int capacity);
+
+    bool insert(quint64 fingerprint); // false if already present
+    bool contains(quint64 fingerprint) const;
+    void remove(quint64 fingerprint);
+    int capacity() const;
+    qint64 memoryUsage() const;
+    double falsePositiveRate() const;
+
+    static quint64 fingerprint(const QByteArray &key);
+
+private:
+    int find(quint64 fingerprint) const;
+
+    QVector<quint64> m_table; // 0 is an empty slot
+    QVector<quint64> m_ring;
+    int m_mask;
+    int m_head;
+    int m_count;
+};
+
+// A client acked message whose key is recorded once the ack is written
+class QStompDedupPending
+{
+public:
+    quint64 m_fingerprint;
+    QString m_subscriptionId;
+    quint64 m_sequence; // delivery order, for cumulative acks
+};
+
+class QStompTimerWheel;
+
+class QStompTimerWheelEntry
+{
+public:
+    enum State { Idle = -1, Due = -2 }; // otherwise the bucket index
+    QStompTimerWheelEntry(QStompClientPrivate *client, void (QStompClientPrivate::*callback)()) :
+        m_prev(nullptr), m_next(nullptr), m_bucket(Idle), m_rounds(0), m_wheel(nullptr),
+        m_client(client), m_callback(callback) { }
+    QStompTimerWheelEntry *m_prev, *m_next;
+    int m_bucket;
+    int m_rounds;
+    QStompTimerWheel *m_wheel;
+    QStompClientPrivate *m_client;
+    void (QStompClientPrivate::*m_callback)();
+};
+
+// Hashed timer wheel, one per thread, ticking only while entries are armed
+class QStompTimerWheel : public QObject
+{
+public:
+    static QStompTimerWheel *instance();
+    QStompTimerWheel();
+
+    void schedule(QStompTimerWheelEntry *entry, int msecs);
+    void cancel(QStompTimerWheelEntry *entry);
+
+protected:
+    void timerEvent(QTimerEvent *event);
+
+private:
+    void unlink(QStompTimerWheelEntry *entry);
+
+    QBasicTimer m_timer;
+    QVector<QStompTimerWheelEntry*> m_buckets;
+    QVector<QStompTimerWheelEntry*> m_due;
+    int m_cursor;
+    int m_count;
 };
 
 class QStompClientPrivate
@@ -64,9 +409,19 @@ class QStompClientPrivate
 public:
     QStompClientPrivate(QStompClient * q) : m_connectionFrame(Stomp::RequestConnect),
         m_stompVersion(Stomp::ProtocolInvalid),
-        m_outgoingPingInternal(0), m_incomingPongInternal(0), m_selfSendFeature(false), counter(0),
-        pq_ptr(q) { }
-    QTimer m_pingTimer, m_pongTimer;
+        m_outgoingPingInternal(0), m_incomingPongInternal(0),
+        m_sharedHeartBeatTimer(false), m_pingEntry(this, &QStompClientPrivate::_q_sendPing),
+        m_pongEntry(this, &QStompClientPrivate::_q_checkPong),
+        m_selfSendFeature(false), counter(0),
+        m_receiptCounter(0), m_receiptTimeout(30000), m_maxPendingReceipts(0), m_receiptsInFlight(0),
+        m_outbox(nullptr), m_bytesQueued(0), m_dedup(nullptr), m_dedupSequence(0),
+        m_compression(false), m_compressionThreshold(1024), m_compressionLevel(-1),
+        m_streamChunkSize(64*1024), m_savedReadBufferSize(0), m_bufferPos(0), m_maxFrameSize(64*1024*1024),
+        m_stats(new QStompStatisticsData), m_capture(nullptr), m_memoryLimit(0), m_readPaused(false),
+        pq_ptr(q) { m_clock.start(); }
+    ~QStompClientPrivate();
+    QTimer m_pingTimer, m_pongTimer, m_batchTimer, m_ackTimer, m_receiptTimer;
+    QElapsedTimer m_clock;
     QTcpSocket * m_socket;
     const QTextCodec * m_textCodec;
 
@@ -78,23 +433,156 @@ public:
     Stomp::Protocol m_stompVersion;
     int m_outgoingPingInternal; // PING emission
     int m_incomingPongInternal; // PING receive from server
-	QDateTime m_lastReceivedPing;
+    QElapsedTimer m_lastRead, m_lastWrite; // any byte counts as heart-beat
+    bool m_sharedHeartBeatTimer;
+    QStompTimerWheelEntry m_pingEntry, m_pongEntry;
 
     bool m_selfSendFeature;
     QString m_selfSendKey;
+    QStompSelfSentMatcher m_selfSentMatcher; // empty session while not connected
+    QByteArray m_selfSentLine;
 
     int counter;
 
-    QList<QStompSubscription> m_subscriptions;
+    // subscriptions grouped by subscriber, and active ones by their subscription id
+    QHash<QObject*, QList<QStompSubscription> > m_subscriptionsBySubscriber;
+    QHash<QString, QStompSubscription> m_subscriptionsById;
+    QHash<QString, QStompSubscription> m_ackOwners; // unacked message id -> subscription
+    QList<QExplicitlySharedDataPointer<QStompSubScriptionData> > m_pendingAckOwners; // subscriptions with deferred acks
+
+    int m_receiptCounter;
+    int m_receiptTimeout;
+    int m_maxPendingReceipts;
+    int m_receiptsInFlight;
+    QHash<QString, QStompPendingReceipt> m_receipts;
+    QMultiMap<qint64, QString> m_receiptDeadlines;
+    QQueue<QPair<QString, QByteArray> > m_receiptBacklog; // waiting for a free slot
+
+    QStompOutbox *m_outbox;
+    QVector<qint64> m_outboxRecordEnds; // of the chunk being replayed, in m_bytesQueued terms
+    QQueue<QByteArray> m_outboxOverflow; // SENDs that found the outbox full while connected
+    qint64 m_bytesQueued; // handed to the socket on this connection
+
+    QStompDedupCache *m_dedup;
+    QString m_dedupKey;
+    QHash<QString, QStompDedupPending> m_dedupPending; // message id -> key not processed yet
+    QHash<QString, QMap<quint64, QString> > m_dedupOrder; // subscription id -> sequence -> message id
+    quint64 m_dedupSequence;
+
+    bool m_compression;
+    int m_compressionThreshold;
+    int m_compressionLevel;
+
+    QStompStreamState m_stream;
+    int m_streamChunkSize;
+    qint64 m_savedReadBufferSize;
+
+    int m_bufferPos; // start of the undecoded part of m_buffer
+    QStompFrameScan m_scan;
+    int m_maxFrameSize;
+
+    QSharedPointer<QStompStatisticsData> m_stats;
+    QFile *m_capture;
+    QElapsedTimer m_captureClock;
 
+    qint64 m_memoryLimit; // 0 means no limit
+    bool m_readPaused;
+
+    QList<QStompSubscription> m_pendingBatches;
+
+    bool resyncBuffer();
     int findMessageBytes();
+    bool frameTooLarge() const;
+    void compactBuffer();
+    qint64 memoryInUse() const;
+    bool checkMemoryLimit();
+    void applyReadLimit(bool wasLimited);
+    void processIncoming(QByteArray data);
+    void finishReadCycle();
+    void captureSegment(const QByteArray &data);
+    void decodeBuffer();
+    bool beginStream();
+    int feedStream(const char *data, int size);
+    void endStream(bool dispatch);
+    void updateSelfSent();
     qint64 send(const QByteArray&);
+    bool compressible(const QStompRequestFrame &frame) const;
+    void compress(QStompRequestFrame &frame) const;
+    QByteArray serialize(const QStompRequestFrame &frame) const;
+    QByteArray unsubscriptionBytes(QStompSubscription &sub);
+    void removeSubscriptions(QObject *subcriber, const QString &destination);
+    void dispatchMessage(QStompSubscription &sub, const QStompResponseFrame &frame);
+    void deliverMessage(QStompSubscription &sub, const QStompResponseFrame &frame);
+    QExplicitlySharedDataPointer<QStompSubScriptionData> acknowledged(const QString &messageId);
+    void dedupAcked(const QString &messageId);
+    void dedupNacked(const QString &messageId);
+    void dedupPending(const QString &messageId, const QString &subscriptionId, quint64 fingerprint);
+    void queueAck(const QExplicitlySharedDataPointer<QStompSubScriptionData> &sd, const QString &messageId);
+    qint64 writeAcks();
+    QByteArray ackBytes(QStompSubScriptionData *sd);
+    QStompRequestFrame sendRequest(const QString &destination, const QString &body, const QString &transactionId, QVariantMap headers) const;
+    bool writeReceiptFrame(const QString &receiptId, const QByteArray &serialized);
+    void completeReceipt(const QString &receiptId, const QStompResponseFrame *frame);
+    void finishReceipt(const QString &receiptId, const QStompResponseFrame *frame);
+    void drainReceiptBacklog();
+    void failAllReceipts();
+    void armReceiptTimer();
+    void armHeartBeat(QTimer &timer, QStompTimerWheelEntry &entry, int msecs);
+    void stopHeartBeat();
+    void replayOutbox();
+    bool spillOutboxOverflow();
+    void advanceOutbox();
+    void stopOutboxReplay();
+    void clearInFlight(QStompSubscription &sub);
 
     void _q_socketReadyRead();
     void _q_sendPing();
     void _q_checkPong();
+    void _q_flushBatches();
+    void _q_flushAcks();
+    void _q_checkReceipts();
+    void _q_checkMemory();
+    void _q_socketBytesWritten();
 private:
     QStompClient * const pq_ptr;
 };
 
+class QStompPublisherBatch
+{
+public:
+    QStompPublisherBatch() : m_attempts(1), m_connection(0) { }
+    QString m_transactionId;
+    QList<QStompRequestFrame> m_messages;
+    QElapsedTimer m_age;
+    int m_attempts;
+    int m_connection; // the transaction was begun on, see m_connections
+};
+
+class QStompBatchPublisherPrivate
+{
+    P_DECLARE_PUBLIC(QStompBatchPublisher);
+public:
+    QStompBatchPublisherPrivate(QStompBatchPublisher * q) : m_maxBatchSize(100), m_maxBatchDelay(50), m_maxRetries(2),
+        m_counter(0), m_connections(0), pq_ptr(q) { }
+    QPointer<QStompClient> m_client;
+    int m_maxBatchSize;
+    int m_maxBatchDelay;
+    int m_maxRetries;
+    int m_counter;
+    int m_connections; // CONNECTED frames seen, transactions die with their connection
+    QTimer m_batchTimer;
+
+    QStompPublisherBatch m_current;
+    QHash<QFutureWatcher<QStompResponseFrame>*, QStompPublisherBatch> m_committing;
+
+    QString nextTransactionId();
+    void beginBatch(QStompPublisherBatch &batch);
+    void commitBatch(const QStompPublisherBatch &batch);
+    void abortBatch(const QStompPublisherBatch &batch);
+    void _q_commitFinished();
+    void _q_clientConnected();
+private:
+    QStompBatchPublisher * const pq_ptr;
+};
+
 #endif // QSTOMP_P_H
@@ -0,0 +1,348 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+#include "mockbroker.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QSysInfo>
+#include <QtCore/QDebug>
+#include <algorithm>
+
+static const QString BenchSentHeader("x-bench-sent");
+static const QString BenchDestination("/topic/bench");
+
+QStompBenchConsumer::QStompBenchConsumer(const QElapsedTimer *clock, QObject *parent) : QObject(parent),
+    m_expected(0), m_received(0), m_clock(clock)
+{
+}
+
+void QStompBenchConsumer::reset(qint64 expected)
+{
+    this->m_expected = expected;
+    this->m_received = 0;
+    this->m_latencies.clear();
+    this->m_latencies.reserve(int(expected));
+}
+
+void QStompBenchConsumer::onMessage(QStompResponseFrame frame)
+{
+    this->m_received++;
+    if(frame.headerHasKey(BenchSentHeader))
+        this->m_latencies.append(this->m_clock->nsecsElapsed() - frame.headerValue(BenchSentHeader).toLongLong());
+    if(this->m_onMessage)
+        this->m_onMessage();
+}
+
+
+QStompBench::QStompBench(QObject *parent) : QObject(parent), m_broker(new QStompMockBroker(this)), m_allocations(-1), m_quick(false)
+{
+    this->m_clock.start();
+}
+
+QStompBench::~QStompBench()
+{
+}
+
+void QStompBench::setQuick(bool quick)
+{
+    this->m_quick = quick;
+}
+
+void QStompBench::setFilter(const QString &filter)
+{
+    this->m_filter = filter;
+}
+
+bool QStompBench::run()
+{
+    if(!this->m_broker->listen()){
+        qCritical() << "Mock broker cannot listen:" << this->m_broker->errorString();
+        return false;
+    }
+
+    this->benchParse();
+    this->benchSerialize();
+
+    bool ok = true;
+    ok &= this->benchThroughput("throughput", 0, 1, 1024);
+    ok &= this->benchThroughput("throughput", 0, 1, 64*1024);
+    ok &= this->benchThroughput("decode_fragmented", 64, 1, 1024);
+    ok &= this->benchThroughput("decode_fragmented", 1, 1, 256);
+    for(int subscriptions : {10, 1000, 10000})
+        ok &= this->benchThroughput("routing", 0, subscriptions, 128);
+    ok &= this->benchLatency(1, 128);
+    ok &= this->benchLatency(64, 128);
+    return ok;
+}
+
+QJsonObject QStompBench::results() const
+{
+    QJsonObject root;
+    root.insert("timestamp", QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+    root.insert("qt", QString(qVersion()));
+    root.insert("cpu", QSysInfo::currentCpuArchitecture());
+    root.insert("os", QSysInfo::prettyProductName());
+    root.insert("quick", this->m_quick);
+    root.insert("allocation_counter", QString(qStompBenchAllocationCounter()));
+    // frame privates are pooled, their header maps are not
+    root.insert("allocation_note", QString("frame header maps (QVariantMap) are still heap allocated per frame"));
+    root.insert("results", this->m_results);
+    return root;
+}
+
+bool QStompBench::selected(const QString &name) const
+{
+    return this->m_filter.isEmpty() || name.contains(this->m_filter);
+}
+
+void QStompBench::record(const QString &name, const QJsonObject &params, qint64 operations, qint64 nsecs, const QJsonObject &extra)
+{
+    QJsonObject result = extra;
+    result.insert("name", name);
+    result.insert("params", params);
+    result.insert("operations", operations);
+    result.insert("ns_per_op", operations ? double(nsecs) / operations : 0.0);
+    result.insert("ops_per_sec", nsecs ? operations * 1e9 / nsecs : 0.0);
+    if(this->m_allocations >= 0 && operations > 0)
+        result.insert("allocs_per_op", double(this->m_allocations) / operations);
+    this->m_allocations = -1;
+    this->m_results.append(result);
+    qInfo().noquote() << name << QJsonDocument(params).toJson(QJsonDocument::Compact)
+                      << QString::number(result.value("ns_per_op").toDouble(), 'f', 1) << "ns/op";
+}
+
+// Runs the operation in growing rounds until a round takes long enough to time
+qint64 QStompBench::measure(const std::function<void()> &operation, qint64 *operations)
+{
+    const qint64 minimum = this->m_quick ? 20000000 : 200000000;
+    qint64 rounds = 1;
+    forever {
+        quint64 allocations = qStompBenchAllocations();
+        QElapsedTimer timer;
+        timer.start();
+        for(qint64 i = 0; i < rounds; i++)
+            operation();
+        qint64 elapsed = timer.nsecsElapsed();
+        if(elapsed >= minimum || rounds >= (qint64(1) << 30)){
+            this->m_allocations = qint64(qStompBenchAllocations() - allocations);
+            *operations = rounds;
+            return elapsed;
+        }
+        rounds *= elapsed > 0 ? qBound<qint64>(2, minimum / elapsed + 1, 100) : 100;
+    }
+}
+
+bool QStompBench::waitFor(const std::function<bool()> &done, int timeoutMs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    while(!done()){
+        if(timer.elapsed() > timeoutMs)
+            return false;
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 50);
+    }
+    return true;
+}
+
+QByteArray QStompBench::messageBytes(int headers, int bodySize)
+{
+    QByteArray bytes("MESSAGE\n");
+    bytes += "destination:" + BenchDestination.toLatin1() + "\n";
+    bytes += "message-id:ID:bench-1:1:1:1:1\n";
+    bytes += "subscription:1\n";
+    for(int i = 3; i < headers; i++)
+        bytes += "x-bench-header-" + QByteArray::number(i) + ":value-" + QByteArray::number(i) + "\n";
+    bytes += "content-length:" + QByteArray::number(bodySize) + "\n\n";
+    bytes += QByteArray(bodySize, 'x');
+    return bytes.append(Stomp::EndFrame);
+}
+
+QJsonObject QStompBench::percentiles(QVector<qint64> values)
+{
+    QJsonObject result;
+    if(values.isEmpty())
+        return result;
+    std::sort(values.begin(), values.end());
+    auto at = [&values](double p) { return double(values.at(qMin(values.size() - 1, int(p * values.size())))) / 1000.0; };
+    result.insert("p50_us", at(0.50));
+    result.insert("p99_us", at(0.99));
+    result.insert("p999_us", at(0.999));
+    result.insert("max_us", double(values.last()) / 1000.0);
+    return result;
+}
+
+void QStompBench::benchParse()
+{
+    if(!this->selected("parse"))
+        return;
+    for(int headers : {4, 16, 64}){
+        for(int bodySize : {0, 1024, 64*1024}){
+            QByteArray bytes = messageBytes(headers, bodySize);
+            qint64 operations;
+            qint64 nsecs = this->measure([&bytes]() {
+                QStompResponseFrame frame(bytes);
+                Q_UNUSED(frame.isValid());
+            }, &operations);
+            this->record("parse", QJsonObject{{"headers", headers}, {"body", bodySize}}, operations, nsecs,
+                         QJsonObject{{"mb_per_sec", operations * double(bytes.size()) * 1e3 / qMax<qint64>(1, nsecs)}});
+        }
+    }
+}
+
+void QStompBench::benchSerialize()
+{
+    if(!this->selected("serialize"))
+        return;
+    for(int headers : {4, 16, 64}){
+        for(int bodySize : {0, 1024, 64*1024}){
+            QStompRequestFrame frame(Stomp::RequestSend);
+            frame.setDestination(BenchDestination);
+            for(int i = 1; i < headers; i++)
+                frame.setHeader(QString("x-bench-header-%1").arg(i), QString("value-%1").arg(i));
+            frame.setRawBody(QByteArray(bodySize, 'x'));
+            frame.setContentLength(uint(bodySize));
+            qint64 operations;
+            qint64 nsecs = this->measure([&frame]() {
+                QByteArray bytes = frame.toByteArray();
+                Q_UNUSED(bytes.size());
+            }, &operations);
+            this->record("serialize", QJsonObject{{"headers", headers}, {"body", bodySize}}, operations, nsecs);
+        }
+    }
+}
+
+bool QStompBench::connectClient(QStompClient *client)
+{
+    bool connected = false;
+    QMetaObject::Connection c = connect(client, &QStompClient::frameConnectedReceived, [&connected]() { connected = true; });
+    client->connectToHost("127.0.0.1", this->m_broker->serverPort());
+    bool ok = this->waitFor([&connected]() { return connected; }, 5000);
+    disconnect(c);
+    if(!ok)
+        qCritical() << "Timed out connecting to the mock broker";
+    return ok;
+}
+
+// Frames are handled in order, so a receipt means everything before it arrived
+bool QStompBench::settle(QStompClient *client)
+{
+    QFuture<QStompResponseFrame> receipt = client->sendWithReceipt("/topic/bench-settle", QString());
+    bool ok = this->waitFor([&receipt]() { return receipt.isFinished(); }, 10000) && !receipt.isCanceled();
+    if(!ok)
+        qCritical() << "Timed out waiting for the mock broker";
+    return ok;
+}
+
+bool QStompBench::benchThroughput(const QString &name, int fragmentSize, int subscriptions, int bodySize)
+{
+    if(!this->selected(name))
+        return true;
+    const qint64 messages = fragmentSize == 1 ? 2000 : (this->m_quick ? 10000 : 100000) / qMax(1, bodySize / 4096);
+
+    QStompClient client;
+    QStompBenchConsumer consumer(&this->m_clock);
+    QStompBenchConsumer others(&this->m_clock);
+    if(!this->connectClient(&client))
+        return false;
+    QStompSubscription sub = client.createSubscription(&consumer, "onMessage(QStompResponseFrame)", BenchDestination);
+    client.registerSubscription(sub);
+    // the other subscriptions only make the routing tables bigger
+    for(int i = 1; i < subscriptions; i++){
+        QStompSubscription other = client.createSubscription(&others, "onMessage(QStompResponseFrame)", QString("/topic/bench-%1").arg(i));
+        client.registerSubscription(other);
+    }
+    if(!this->settle(&client))
+        return false;
+
+    this->m_broker->setFragmentSize(fragmentSize);
+    consumer.reset(messages);
+    QString body(bodySize, 'x');
+    quint64 allocations = qStompBenchAllocations();
+    QElapsedTimer timer;
+    timer.start();
+    for(qint64 i = 0; i < messages; i++)
+        client.send(BenchDestination, body);
+    bool ok = this->waitFor([&consumer]() { return consumer.m_received >= consumer.m_expected; }, 120000);
+    qint64 nsecs = timer.nsecsElapsed();
+    this->m_allocations = qint64(qStompBenchAllocations() - allocations);
+    this->m_broker->setFragmentSize(0);
+    client.disconnectFromHost();
+    if(!ok){
+        qCritical() << name << "received" << consumer.m_received << "of" << messages << "messages";
+        return false;
+    }
+
+    QJsonObject params{{"body", bodySize}, {"subscriptions", subscriptions}, {"fragment", fragmentSize}};
+    this->record(name, params, messages, nsecs,
+                 QJsonObject{{"mb_per_sec", messages * double(bodySize) * 1e3 / qMax<qint64>(1, nsecs)}});
+    return true;
+}
+
+// Closed loop: 'window' messages are in flight, each arrival sends the next one
+bool QStompBench::benchLatency(int window, int bodySize)
+{
+    if(!this->selected("latency"))
+        return true;
+    const qint64 messages = this->m_quick ? 2000 : 20000;
+
+    QStompClient client;
+    QStompBenchConsumer consumer(&this->m_clock);
+    if(!this->connectClient(&client))
+        return false;
+    QStompSubscription sub = client.createSubscription(&consumer, "onMessage(QStompResponseFrame)", BenchDestination);
+    client.registerSubscription(sub);
+    if(!this->settle(&client))
+        return false;
+
+    QString body(bodySize, 'x');
+    qint64 sent = 0;
+    auto sendOne = [&]() {
+        QVariantMap headers;
+        headers.insert(BenchSentHeader, this->m_clock.nsecsElapsed());
+        client.send(BenchDestination, body, QString(), headers);
+        sent++;
+    };
+    consumer.reset(messages);
+    consumer.m_onMessage = [&]() {
+        if(sent < messages)
+            sendOne();
+    };
+    quint64 allocations = qStompBenchAllocations();
+    QElapsedTimer timer;
+    timer.start();
+    for(int i = 0; i < window && sent < messages; i++)
+        sendOne();
+    bool ok = this->waitFor([&consumer]() { return consumer.m_received >= consumer.m_expected; }, 120000);
+    qint64 nsecs = timer.nsecsElapsed();
+    this->m_allocations = qint64(qStompBenchAllocations() - allocations);
+    consumer.m_onMessage = nullptr;
+    client.disconnectFromHost();
+    if(!ok){
+        qCritical() << "latency received" << consumer.m_received << "of" << messages << "messages";
+        return false;
+    }
+
+    this->record("latency", QJsonObject{{"body", bodySize}, {"window", window}}, messages, nsecs,
+                 percentiles(consumer.m_latencies));
+    return true;
+}
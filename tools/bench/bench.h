@@ -0,0 +1,97 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QSTOMPBENCH_H
+#define QSTOMPBENCH_H
+
+#include <qstomp.h>
+
+#include <QtCore/QObject>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonObject>
+#include <QtCore/QVector>
+#include <functional>
+
+class QStompMockBroker;
+
+// heap allocations made by the process so far, see allocations.cpp
+quint64 qStompBenchAllocations();
+// what is counted: "malloc" (every C heap call) or "operator new" only
+const char *qStompBenchAllocationCounter();
+
+class QStompBenchConsumer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QStompBenchConsumer(const QElapsedTimer *clock, QObject *parent = nullptr);
+    void reset(qint64 expected);
+
+    qint64 m_expected;
+    qint64 m_received;
+    QVector<qint64> m_latencies; // ns, from the x-bench-sent header
+    std::function<void()> m_onMessage;
+
+public slots:
+    void onMessage(QStompResponseFrame frame);
+
+private:
+    const QElapsedTimer *m_clock;
+};
+
+// Micro benchmarks of the frame codec plus end-to-end runs against an
+// in-process QStompMockBroker; results are collected as JSON
+class QStompBench : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QStompBench(QObject *parent = nullptr);
+    ~QStompBench();
+
+    void setQuick(bool quick);
+    void setFilter(const QString &filter);
+    bool run();
+    QJsonObject results() const;
+
+private:
+    bool selected(const QString &name) const;
+    void record(const QString &name, const QJsonObject &params, qint64 operations, qint64 nsecs, const QJsonObject &extra = QJsonObject());
+    qint64 measure(const std::function<void()> &operation, qint64 *operations);
+    bool waitFor(const std::function<bool()> &done, int timeoutMs);
+    static QByteArray messageBytes(int headers, int bodySize);
+    static QJsonObject percentiles(QVector<qint64> values);
+
+    void benchParse();
+    void benchSerialize();
+    bool benchThroughput(const QString &name, int fragmentSize, int subscriptions, int bodySize);
+    bool benchLatency(int window, int bodySize);
+
+    bool connectClient(QStompClient *client);
+    bool settle(QStompClient *client);
+
+    QStompMockBroker *m_broker;
+    QElapsedTimer m_clock;
+    QJsonArray m_results;
+    qint64 m_allocations; // during the last measured run, -1 if not counted
+    QString m_filter;
+    bool m_quick;
+};
+
+#endif // QSTOMPBENCH_H
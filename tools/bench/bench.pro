@@ -0,0 +1,30 @@
+#
+# This file is part of QStomp
+#
+# Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+#
+# This library is free software: you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation, either
+# version 3 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General
+# Public License along with this library; see the file
+# COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+include(../tools.pri)
+
+TARGET = qstomp-bench
+INCLUDEPATH += ../mockbroker
+SOURCES += main.cpp \
+    bench.cpp \
+    allocations.cpp \
+    ../mockbroker/mockbroker.cpp
+HEADERS += bench.h \
+    ../mockbroker/mockbroker.h
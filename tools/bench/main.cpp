@@ -0,0 +1,65 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QFile>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QDebug>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qstomp-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("QStomp codec, dispatch and throughput benchmarks");
+    parser.addHelpOption();
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "Write the JSON results to <file> instead of stdout.", "file");
+    QCommandLineOption filterOption("filter", "Only run benchmarks whose name contains <name>.", "name");
+    QCommandLineOption quickOption("quick", "Shorter runs, for smoke testing.");
+    parser.addOptions({outputOption, filterOption, quickOption});
+    parser.process(app);
+
+    // keep the library's own logging out of the measurements
+    QLoggingCategory::setFilterRules("*.debug=false");
+    QStompBench bench;
+    bench.setQuick(parser.isSet(quickOption));
+    bench.setFilter(parser.value(filterOption));
+    bool ok = bench.run();
+
+    QByteArray json = QJsonDocument(bench.results()).toJson();
+    if(parser.isSet(outputOption)){
+        QFile file(parser.value(outputOption));
+        if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate)){
+            qCritical() << "Cannot write" << file.fileName();
+            return 1;
+        }
+        file.write(json);
+    }else{
+        QFile out;
+        out.open(stdout, QIODevice::WriteOnly);
+        out.write(json);
+    }
+    return ok ? 0 : 1;
+}
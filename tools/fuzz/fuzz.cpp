@@ -0,0 +1,153 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <qstomp.h>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QLoggingCategory>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Frames over this size close the connection, it also bounds inflated bodies
+static const int MaxFrameSize = 64*1024;
+// Decoding may take this long per input byte, plus twice that per read for
+// the fixed cost of a read cycle and a small allowance for timer noise. A
+// linear release build stays well below 1 us per byte, so a rescan of the
+// buffer per read fails as soon as inputs reach a few KB (libFuzzer is run
+// with -max_len=65536 by default). QSTOMP_FUZZ_NS_PER_BYTE overrides it for
+// slow (e.g. debug) builds
+static const qint64 DefaultNsPerByte = 1000;
+static const qint64 FixedAllowanceNs = 1000*1000;
+
+static qint64 nsPerByte = DefaultNsPerByte;
+
+static void fail(const char *what, qint64 value, qint64 ceiling)
+{
+    fprintf(stderr, "qstomp-fuzz: %s %lld is over the ceiling of %lld\n", what, (long long) value, (long long) ceiling);
+    abort();
+}
+
+// Feeds data in the chunk sizes chosen by nextChunk and checks the ceilings
+// after every read, as the socket would deliver it
+template<typename ChunkFunc>
+static void feed(const char *data, int size, ChunkFunc nextChunk)
+{
+    QStompClient client;
+    client.setMaxFrameSize(MaxFrameSize);
+
+    // only the decoding is timed, not the checks
+    qint64 elapsed = 0;
+    int reads = 0;
+    QElapsedTimer timer;
+    int pos = 0;
+    while(pos < size){
+        int chunk = qMin(nextChunk(), size - pos);
+        timer.start();
+        client.injectReceivedData(QByteArray::fromRawData(data + pos, chunk));
+        elapsed += timer.nsecsElapsed();
+        pos += chunk;
+        reads++;
+
+        // the buffer holds at most one incomplete frame and the part of the
+        // last read that was not decoded yet
+        QStompClientStatistics stats = client.statistics();
+        if(stats.receiveBufferBytes > qint64(MaxFrameSize) + chunk)
+            fail("receive buffer of", stats.receiveBufferBytes, qint64(MaxFrameSize) + chunk);
+    }
+    // run the queued slot calls so dispatched frames are released
+    timer.start();
+    QCoreApplication::sendPostedEvents();
+    elapsed += timer.nsecsElapsed();
+
+    qint64 ceiling = FixedAllowanceNs + nsPerByte * (size + 2 * qint64(reads));
+    if(elapsed > ceiling)
+        fail("decode time (ns) of", elapsed, ceiling);
+}
+
+extern "C" int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    // Unless given on the command line, no single allocation may exceed
+    // 64 MB (content-length or a compression prefix taken at face value),
+    // the process stays under 1 GB and inputs go up to 64 KB. libFuzzer
+    // reads its flags after this
+    static QVector<char*> args;
+    bool mallocLimit = false, rssLimit = false, maxLen = false;
+    for(int i = 0; i < *argc; i++){
+        args.append((*argv)[i]);
+        mallocLimit |= strncmp((*argv)[i], "-malloc_limit_mb=", 17) == 0;
+        rssLimit |= strncmp((*argv)[i], "-rss_limit_mb=", 14) == 0;
+        maxLen |= strncmp((*argv)[i], "-max_len=", 9) == 0;
+    }
+    static char mallocFlag[] = "-malloc_limit_mb=64";
+    static char rssFlag[] = "-rss_limit_mb=1024";
+    // inputs large enough for quadratic scans to stand out from the budget
+    static char maxLenFlag[] = "-max_len=65536";
+    if(!mallocLimit)
+        args.insert(1, mallocFlag);
+    if(!rssLimit)
+        args.insert(1, rssFlag);
+    if(!maxLen)
+        args.insert(1, maxLenFlag);
+    args.append(nullptr);
+    *argc = args.size() - 1;
+    *argv = args.data();
+
+    QByteArray value = qgetenv("QSTOMP_FUZZ_NS_PER_BYTE");
+    if(!value.isEmpty())
+        nsPerByte = value.toLongLong();
+
+    static int appArgc = 1;
+    static char *appArgv[] = { (*argv)[0], nullptr };
+    new QCoreApplication(appArgc, appArgv);
+    QLoggingCategory::setFilterRules("qstomp.*=false");
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if(size > size_t(16*1024*1024))
+        return 0;
+    const char *bytes = reinterpret_cast<const char*>(data);
+    int length = int(size);
+
+    // one byte per read, the worst case for the incremental scanner
+    feed(bytes, length, [] { return 1; });
+
+    // random reads of 1..4096 bytes, seeded from the input so a crash reproduces
+    quint32 state = 2166136261u;
+    for(int i = 0; i < length; i++)
+        state = (state ^ data[i]) * 16777619u;
+    if(state == 0)
+        state = 1;
+    feed(bytes, length, [&state] {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return int(state % 4096) + 1;
+    });
+
+    // everything in a single read
+    if(length > 0)
+        feed(bytes, length, [length] { return length; });
+    return 0;
+}
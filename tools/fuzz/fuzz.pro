@@ -0,0 +1,29 @@
+#
+# This file is part of QStomp
+#
+# Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+#
+# This library is free software: you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation, either
+# version 3 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General
+# Public License along with this library; see the file
+# COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+include(../tools.pri)
+
+# libFuzzer provides main(); build with clang. The library should be built
+# with CONFIG+=qstomp_fuzz as well so the decoder is instrumented for coverage
+TARGET = qstomp-fuzz
+CONFIG -= console
+QMAKE_CXXFLAGS += -fsanitize=fuzzer,address,undefined
+QMAKE_LFLAGS += -fsanitize=fuzzer,address,undefined
+SOURCES += fuzz.cpp
@@ -0,0 +1,55 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mockbroker.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QDebug>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qstomp-mockbroker");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("In-process STOMP broker for QStomp tests and benchmarks");
+    parser.addHelpOption();
+    QCommandLineOption bindOption("bind", "Address to listen on.", "address", "127.0.0.1");
+    QCommandLineOption portOption("port", "Port to listen on.", "port", "61613");
+    QCommandLineOption latencyOption("latency", "Delay every write by <ms>.", "ms", "0");
+    QCommandLineOption fragmentOption("fragment", "Split writes into <bytes> sized segments.", "bytes", "0");
+    QCommandLineOption slowReadOption("slow-read", "Read at most <bytes> per 10 ms from each client.", "bytes", "0");
+    QCommandLineOption heartBeatOption("heart-beat", "Heart-beat interval offered to clients.", "ms", "0");
+    parser.addOptions({bindOption, portOption, latencyOption, fragmentOption, slowReadOption, heartBeatOption});
+    parser.process(app);
+
+    QStompMockBroker broker;
+    broker.setLatency(parser.value(latencyOption).toInt());
+    broker.setFragmentSize(parser.value(fragmentOption).toInt());
+    broker.setSlowReader(parser.value(slowReadOption).toInt());
+    broker.setHeartBeat(parser.value(heartBeatOption).toInt());
+    if(!broker.listen(QHostAddress(parser.value(bindOption)), quint16(parser.value(portOption).toUInt()))){
+        qCritical() << "Cannot listen:" << broker.errorString();
+        return 1;
+    }
+    qInfo() << "Listening on" << parser.value(bindOption) << broker.serverPort();
+    return app.exec();
+}
@@ -0,0 +1,468 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mockbroker.h"
+
+#include <QtCore/QPointer>
+#include <QtCore/QStringList>
+#include <QtNetwork/QTcpSocket>
+
+QStompMockBroker::QStompMockBroker(QObject *parent) : QObject(parent),
+    m_latency(0), m_fragmentSize(0), m_slowReadBytes(0), m_heartBeat(0),
+    m_sessionCounter(0), m_messageCounter(0), m_framesIn(0), m_messagesOut(0), m_bytesIn(0), m_bytesOut(0)
+{
+    connect(&this->m_server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+    connect(&this->m_readTimer, SIGNAL(timeout()), this, SLOT(onReadTick()));
+    connect(&this->m_heartBeatTimer, SIGNAL(timeout()), this, SLOT(onHeartBeatTick()));
+}
+
+QStompMockBroker::~QStompMockBroker()
+{
+    this->close();
+}
+
+bool QStompMockBroker::listen(const QHostAddress &address, quint16 port)
+{
+    return this->m_server.listen(address, port);
+}
+
+void QStompMockBroker::close()
+{
+    this->m_server.close();
+    // nobody is left to take redeliveries
+    this->m_routes.clear();
+    for(QTcpSocket *socket : this->m_connections.keys()){
+        socket->abort();
+        this->removeConnection(socket);
+    }
+}
+
+quint16 QStompMockBroker::serverPort() const
+{
+    return this->m_server.serverPort();
+}
+
+QString QStompMockBroker::errorString() const
+{
+    return this->m_server.errorString();
+}
+
+void QStompMockBroker::setLatency(int msecs)
+{
+    this->m_latency = qMax(0, msecs);
+}
+
+int QStompMockBroker::latency() const
+{
+    return this->m_latency;
+}
+
+void QStompMockBroker::setFragmentSize(int bytes)
+{
+    this->m_fragmentSize = qMax(0, bytes);
+}
+
+int QStompMockBroker::fragmentSize() const
+{
+    return this->m_fragmentSize;
+}
+
+void QStompMockBroker::setSlowReader(int bytes, int tickMsecs)
+{
+    this->m_slowReadBytes = qMax(0, bytes);
+    for(QTcpSocket *socket : this->m_connections.keys())
+        socket->setReadBufferSize(this->m_slowReadBytes);
+    if(this->m_slowReadBytes > 0)
+        this->m_readTimer.start(qMax(1, tickMsecs));
+    else
+        this->m_readTimer.stop();
+}
+
+int QStompMockBroker::slowReaderBytes() const
+{
+    return this->m_slowReadBytes;
+}
+
+void QStompMockBroker::setHeartBeat(int msecs)
+{
+    this->m_heartBeat = qMax(0, msecs);
+    if(this->m_heartBeat > 0)
+        this->m_heartBeatTimer.start(qMax(1, this->m_heartBeat / 4));
+    else
+        this->m_heartBeatTimer.stop();
+}
+
+int QStompMockBroker::heartBeat() const
+{
+    return this->m_heartBeat;
+}
+
+int QStompMockBroker::connectionCount() const
+{
+    return this->m_connections.size();
+}
+
+quint64 QStompMockBroker::framesReceived() const
+{
+    return this->m_framesIn;
+}
+
+quint64 QStompMockBroker::messagesDelivered() const
+{
+    return this->m_messagesOut;
+}
+
+quint64 QStompMockBroker::bytesReceived() const
+{
+    return this->m_bytesIn;
+}
+
+quint64 QStompMockBroker::bytesWritten() const
+{
+    return this->m_bytesOut;
+}
+
+void QStompMockBroker::onNewConnection()
+{
+    while(QTcpSocket *socket = this->m_server.nextPendingConnection()){
+        Connection *c = new Connection;
+        c->m_socket = socket;
+        c->m_lastWrite.start();
+        // small fragments have to leave as separate segments
+        socket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+        if(this->m_slowReadBytes > 0)
+            socket->setReadBufferSize(this->m_slowReadBytes);
+        this->m_connections.insert(socket, c);
+        connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    }
+}
+
+void QStompMockBroker::onReadyRead()
+{
+    // a slow reader only reads on its own ticks
+    if(this->m_slowReadBytes > 0)
+        return;
+    Connection *c = this->m_connections.value(qobject_cast<QTcpSocket*>(this->sender()));
+    if(c)
+        this->readFrom(c, -1);
+}
+
+void QStompMockBroker::onDisconnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(this->sender());
+    if(socket)
+        this->removeConnection(socket);
+}
+
+void QStompMockBroker::onReadTick()
+{
+    for(Connection *c : this->m_connections.values())
+        this->readFrom(c, this->m_slowReadBytes);
+}
+
+void QStompMockBroker::onHeartBeatTick()
+{
+    for(Connection *c : this->m_connections){
+        if(c->m_heartBeatOut > 0 && c->m_lastWrite.elapsed() >= c->m_heartBeatOut)
+            this->write(c, Stomp::PingContent);
+    }
+}
+
+void QStompMockBroker::readFrom(Connection *c, qint64 maxBytes)
+{
+    if(c->m_closing)
+        return;
+    QByteArray data = maxBytes < 0 ? c->m_socket->readAll() : c->m_socket->read(maxBytes);
+    if(data.isEmpty())
+        return;
+    this->m_bytesIn += quint64(data.size());
+    c->m_buffer.append(data);
+    this->processBuffer(c);
+}
+
+void QStompMockBroker::processBuffer(Connection *c)
+{
+    const QByteArray &buffer = c->m_buffer;
+    int pos = 0;
+    forever {
+        // heart-beats between frames
+        while(pos < buffer.size() && (buffer.at(pos) == '\n' || buffer.at(pos) == '\r'))
+            pos++;
+        int headerEnd = buffer.indexOf("\n\n", pos);
+        if(headerEnd == -1)
+            break;
+        int bodyStart = headerEnd + 2;
+        int frameEnd;
+        int cl = buffer.indexOf("\ncontent-length:", pos);
+        if(cl != -1 && cl < headerEnd){
+            int valueStart = cl + 16;
+            int valueEnd = buffer.indexOf('\n', valueStart);
+            bool ok = false;
+            int length = buffer.mid(valueStart, valueEnd - valueStart).trimmed().toInt(&ok);
+            if(!ok || length < 0){
+                this->write(c, QStompResponseFrame(Stomp::ResponseError).toByteArray().append(Stomp::EndFrame));
+                this->closeConnection(c);
+                return;
+            }
+            if(buffer.size() < bodyStart + length + 1)
+                break;
+            frameEnd = bodyStart + length;
+        }else{
+            frameEnd = buffer.indexOf('\0', bodyStart);
+            if(frameEnd == -1)
+                break;
+        }
+        QStompRequestFrame frame(buffer.mid(pos, frameEnd - pos));
+        pos = frameEnd + 1;
+        this->m_framesIn++;
+        this->handleFrame(c, frame);
+        if(c->m_closing)
+            return;
+    }
+    c->m_buffer.remove(0, pos);
+}
+
+void QStompMockBroker::handleFrame(Connection *c, const QStompRequestFrame &frame)
+{
+    if(!frame.isValid()){
+        QStompResponseFrame error(Stomp::ResponseError);
+        error.setMessage("invalid frame");
+        this->write(c, error.toByteArray().append(Stomp::EndFrame));
+        this->closeConnection(c);
+        return;
+    }
+
+    switch(frame.type()){
+    case Stomp::RequestConnect: {
+        c->m_session = QString("mock-%1").arg(++this->m_sessionCounter);
+        QStompResponseFrame connected(Stomp::ResponseConnected);
+        connected.setHeader(Stomp::HeaderConnectedVersion, Stomp::ProtocolList.first());
+        connected.setHeader(Stomp::HeaderConnectedServer, "qstomp-mockbroker");
+        connected.setHeader(Stomp::HeaderConnectedSession, c->m_session);
+        QStringList heartBeat = frame.headerValue(Stomp::HeaderConnectHeartBeat).toString().split(',');
+        int clientWants = heartBeat.size() == 2 ? heartBeat.at(1).trimmed().toInt() : 0;
+        c->m_heartBeatOut = (this->m_heartBeat > 0 && clientWants > 0) ? qMax(this->m_heartBeat, clientWants) : 0;
+        // advertise what was negotiated; incoming pings are never checked
+        connected.setHeader(Stomp::HeaderConnectedHeartBeat, QString("%1,%2").arg(c->m_heartBeatOut).arg(0));
+        this->write(c, connected.toByteArray().append(Stomp::EndFrame));
+        break;
+    }
+    case Stomp::RequestSubscribe: {
+        QString id = frame.headerValue(Stomp::HeaderRequestSubscription).toString();
+        Subscription &sub = c->m_subscriptions[id];
+        sub.m_destination = frame.destination();
+        sub.m_ackType = frame.ackType();
+        this->m_routes[sub.m_destination].append(qMakePair(c, id));
+        break;
+    }
+    case Stomp::RequestUnsubscribe:
+        this->redeliver(this->dropSubscription(c, frame.headerValue(Stomp::HeaderRequestSubscription).toString()));
+        break;
+    case Stomp::RequestSend:
+        if(frame.hasTransactionId() && c->m_transactions.contains(frame.transactionId()))
+            c->m_transactions[frame.transactionId()].append(frame);
+        else
+            this->deliver(frame);
+        break;
+    case Stomp::RequestBegin:
+        c->m_transactions.insert(frame.transactionId(), QList<QStompRequestFrame>());
+        break;
+    case Stomp::RequestCommit:
+        for(const QStompRequestFrame &send : c->m_transactions.take(frame.transactionId()))
+            this->deliver(send);
+        break;
+    case Stomp::RequestAbort:
+        c->m_transactions.remove(frame.transactionId());
+        break;
+    case Stomp::RequestAck:
+    case Stomp::RequestNack: {
+        // STOMP 1.2 names the message in id, older clients in message-id;
+        // transactional acks are settled right away
+        QString messageId = frame.headerHasKey(Stomp::HeaderRequestSubscription)
+                ? frame.headerValue(Stomp::HeaderRequestSubscription).toString() : frame.messageId();
+        this->settle(c, messageId, frame.type() == Stomp::RequestNack);
+        break;
+    }
+    case Stomp::RequestDisconnect:
+        if(frame.hasReceiptId()){
+            QStompResponseFrame receipt(Stomp::ResponseReceipt);
+            receipt.setReceiptId(frame.receiptId());
+            this->write(c, receipt.toByteArray().append(Stomp::EndFrame));
+        }
+        this->closeConnection(c);
+        return;
+    default:
+        break;
+    }
+
+    if(frame.hasReceiptId()){
+        QStompResponseFrame receipt(Stomp::ResponseReceipt);
+        receipt.setReceiptId(frame.receiptId());
+        this->write(c, receipt.toByteArray().append(Stomp::EndFrame));
+    }
+}
+
+void QStompMockBroker::deliver(const QStompRequestFrame &frame)
+{
+    auto route = this->m_routes.constFind(frame.destination());
+    if(route == this->m_routes.constEnd() || route->isEmpty())
+        return;
+
+    Message message;
+    message.m_id = QString("m-%1").arg(++this->m_messageCounter);
+    message.m_destination = frame.destination();
+    QStompResponseFrame response(Stomp::ResponseMessage);
+    response.setHeader(frame.header());
+    response.removeHeader(Stomp::HeaderRequestTransactionID);
+    response.removeHeader(Stomp::HeaderRequestReceiptID);
+    response.setMessageId(message.m_id);
+    response.setRawBody(frame.rawBody());
+    response.setContentLength(uint(frame.rawBody().size()));
+    // serialize once and splice in what differs per subscriber
+    message.m_serialized = response.toByteArray().append(Stomp::EndFrame);
+
+    for(const QPair<Connection*, QString> &target : *route)
+        this->deliverTo(target.first, target.second, message, false);
+}
+
+void QStompMockBroker::deliverTo(Connection *c, const QString &subscriptionId, const Message &message, bool redelivered)
+{
+    auto sub = c->m_subscriptions.find(subscriptionId);
+    if(sub == c->m_subscriptions.end())
+        return;
+    if(sub->m_ackType != Stomp::AckAuto){
+        sub->m_unacked.append(message);
+        c->m_ackOwners.insert(message.m_id, subscriptionId);
+    }
+
+    QByteArray lines = QByteArray("subscription:") + subscriptionId.toLatin1() + "\nack:" + message.m_id.toLatin1() + '\n';
+    if(redelivered)
+        lines += "redelivered:true\n";
+    QByteArray bytes = message.m_serialized;
+    bytes.insert(bytes.indexOf('\n') + 1, lines);
+    this->write(c, bytes);
+    this->m_messagesOut++;
+}
+
+// An ACK or NACK in client mode covers every message delivered before it
+void QStompMockBroker::settle(Connection *c, const QString &messageId, bool nack)
+{
+    auto owner = c->m_ackOwners.find(messageId);
+    if(owner == c->m_ackOwners.end())
+        return;
+    auto sub = c->m_subscriptions.find(owner.value());
+    if(sub == c->m_subscriptions.end())
+        return;
+
+    QList<Message> settled;
+    for(int i = 0; i < sub->m_unacked.size(); ){
+        const Message &message = sub->m_unacked.at(i);
+        if(message.m_id == messageId || sub->m_ackType == Stomp::AckClient){
+            bool last = message.m_id == messageId;
+            c->m_ackOwners.remove(message.m_id);
+            settled << sub->m_unacked.takeAt(i);
+            if(last)
+                break;
+        }else{
+            i++;
+        }
+    }
+    if(nack)
+        this->redeliver(settled);
+}
+
+QList<QStompMockBroker::Message> QStompMockBroker::dropSubscription(Connection *c, const QString &subscriptionId)
+{
+    auto sub = c->m_subscriptions.find(subscriptionId);
+    if(sub == c->m_subscriptions.end())
+        return QList<Message>();
+    QList<Message> unacked = sub->m_unacked;
+    for(const Message &message : unacked)
+        c->m_ackOwners.remove(message.m_id);
+    this->m_routes[sub->m_destination].removeAll(qMakePair(c, subscriptionId));
+    c->m_subscriptions.erase(sub);
+    return unacked;
+}
+
+// Each message goes to the first subscriber of its destination that is not closing
+void QStompMockBroker::redeliver(const QList<Message> &messages)
+{
+    for(const Message &message : messages){
+        for(const QPair<Connection*, QString> &target : this->m_routes.value(message.m_destination)){
+            if(!target.first->m_closing){
+                this->deliverTo(target.first, target.second, message, true);
+                break;
+            }
+        }
+    }
+}
+
+void QStompMockBroker::write(Connection *c, const QByteArray &bytes)
+{
+    c->m_lastWrite.restart();
+    if(this->m_latency <= 0){
+        this->writeNow(c->m_socket, bytes);
+        return;
+    }
+    // timers of the same interval fire in the order they were started
+    QPointer<QTcpSocket> socket(c->m_socket);
+    QTimer::singleShot(this->m_latency, this, [this, socket, bytes](){
+        if(socket)
+            this->writeNow(socket, bytes);
+    });
+}
+
+void QStompMockBroker::writeNow(QTcpSocket *socket, const QByteArray &bytes)
+{
+    this->m_bytesOut += quint64(bytes.size());
+    if(this->m_fragmentSize <= 0 || bytes.size() <= this->m_fragmentSize){
+        socket->write(bytes);
+        return;
+    }
+    for(int i = 0; i < bytes.size(); i += this->m_fragmentSize){
+        socket->write(bytes.constData() + i, qMin(this->m_fragmentSize, bytes.size() - i));
+        socket->flush();
+    }
+}
+
+void QStompMockBroker::closeConnection(Connection *c)
+{
+    c->m_closing = true;
+    QPointer<QTcpSocket> socket(c->m_socket);
+    // let queued writes leave first
+    QTimer::singleShot(this->m_latency, this, [socket](){
+        if(socket)
+            socket->disconnectFromHost();
+    });
+}
+
+void QStompMockBroker::removeConnection(QTcpSocket *socket)
+{
+    Connection *c = this->m_connections.take(socket);
+    if(!c)
+        return;
+    QList<Message> unacked;
+    for(const QString &subscriptionId : c->m_subscriptions.keys())
+        unacked += this->dropSubscription(c, subscriptionId);
+    delete c;
+    socket->deleteLater();
+    this->redeliver(unacked);
+}
@@ -0,0 +1,140 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QSTOMPMOCKBROKER_H
+#define QSTOMPMOCKBROKER_H
+
+#include <qstomp.h>
+
+#include <QtCore/QObject>
+#include <QtCore/QHash>
+#include <QtCore/QTimer>
+#include <QtCore/QElapsedTimer>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QHostAddress>
+
+class QTcpSocket;
+
+// A minimal STOMP 1.2 broker for local tests and benchmarks. Destinations are
+// plain topics: every SEND is delivered to all current subscribers of its
+// destination and nothing is stored. Messages delivered to client and
+// client-individual subscriptions are kept until acked; a NACK, UNSUBSCRIBE or
+// disconnect hands them to one remaining subscriber of the destination, with
+// redelivered:true, or drops them if there is none.
+class QStompMockBroker : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QStompMockBroker(QObject *parent = nullptr);
+    ~QStompMockBroker();
+
+    bool listen(const QHostAddress &address = QHostAddress::LocalHost, quint16 port = 0);
+    void close();
+    quint16 serverPort() const;
+    QString errorString() const;
+
+    // delay in ms applied to everything the broker writes
+    void setLatency(int msecs);
+    int latency() const;
+    // split every write into chunks of that many bytes, 0 writes whole frames
+    void setFragmentSize(int bytes);
+    int fragmentSize() const;
+    // read at most 'bytes' per tick from each client, 0 reads as fast as possible
+    void setSlowReader(int bytes, int tickMsecs = 10);
+    int slowReaderBytes() const;
+    // least interval between the broker's heart-beats, the larger of this and the
+    // client's wish is advertised in CONNECTED; 0 disables heart-beats
+    void setHeartBeat(int msecs);
+    int heartBeat() const;
+
+    int connectionCount() const;
+    quint64 framesReceived() const;
+    quint64 messagesDelivered() const;
+    quint64 bytesReceived() const;
+    quint64 bytesWritten() const;
+
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onDisconnected();
+    void onReadTick();
+    void onHeartBeatTick();
+
+private:
+    // MESSAGE serialized without its subscription and ack headers
+    class Message
+    {
+    public:
+        QString m_id;
+        QString m_destination;
+        QByteArray m_serialized;
+    };
+
+    class Subscription
+    {
+    public:
+        Subscription() : m_ackType(Stomp::AckAuto) { }
+        QString m_destination;
+        Stomp::AckType m_ackType;
+        QList<Message> m_unacked; // in delivery order
+    };
+
+    class Connection
+    {
+    public:
+        Connection() : m_socket(nullptr), m_heartBeatOut(0), m_closing(false) { }
+        QTcpSocket *m_socket;
+        QByteArray m_buffer;
+        QString m_session;
+        QHash<QString, Subscription> m_subscriptions; // by id
+        QHash<QString, QString> m_ackOwners; // unacked message id -> subscription id
+        QHash<QString, QList<QStompRequestFrame> > m_transactions;
+        int m_heartBeatOut;
+        bool m_closing; // no further frames are read
+        QElapsedTimer m_lastWrite;
+    };
+
+    void readFrom(Connection *c, qint64 maxBytes);
+    void processBuffer(Connection *c);
+    void handleFrame(Connection *c, const QStompRequestFrame &frame);
+    void deliver(const QStompRequestFrame &frame);
+    void deliverTo(Connection *c, const QString &subscriptionId, const Message &message, bool redelivered);
+    void settle(Connection *c, const QString &messageId, bool nack);
+    QList<Message> dropSubscription(Connection *c, const QString &subscriptionId);
+    void redeliver(const QList<Message> &messages);
+    void write(Connection *c, const QByteArray &bytes);
+    void writeNow(QTcpSocket *socket, const QByteArray &bytes);
+    void closeConnection(Connection *c);
+    void removeConnection(QTcpSocket *socket);
+
+    QTcpServer m_server;
+    QHash<QTcpSocket*, Connection*> m_connections;
+    QHash<QString, QList<QPair<Connection*, QString> > > m_routes; // destination -> (connection, subscription id)
+    QTimer m_readTimer, m_heartBeatTimer;
+    int m_latency;
+    int m_fragmentSize;
+    int m_slowReadBytes;
+    int m_heartBeat;
+    quint64 m_sessionCounter;
+    quint64 m_messageCounter;
+    quint64 m_framesIn, m_messagesOut, m_bytesIn, m_bytesOut;
+};
+
+#endif // QSTOMPMOCKBROKER_H
@@ -0,0 +1,103 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "perf.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QDebug>
+
+// "1024", "100-4096" (uniform range) or "100,1000,10000" (one picked at random)
+static bool parseSizes(const QString &spec, QStompPerfOptions *options)
+{
+    options->sizes.clear();
+    options->sizeRange = spec.contains('-');
+    for(const QString &part : spec.split(options->sizeRange ? '-' : ',')){
+        bool ok = false;
+        int size = part.trimmed().toInt(&ok);
+        if(!ok || size < 0)
+            return false;
+        options->sizes << size;
+    }
+    if(options->sizeRange && (options->sizes.size() != 2 || options->sizes.first() > options->sizes.last()))
+        return false;
+    return !options->sizes.isEmpty();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qstomp-perf");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Load generator and latency measurement for QStomp");
+    parser.addHelpOption();
+    QCommandLineOption hostOption("host", "Broker host.", "host", "127.0.0.1");
+    QCommandLineOption portOption("port", "Broker port.", "port", "61613");
+    QCommandLineOption mockOption("mock", "Run against an in-process mock broker.");
+    QCommandLineOption producersOption(QStringList() << "x" << "producers", "Number of producers.", "n", "1");
+    QCommandLineOption consumersOption(QStringList() << "y" << "consumers", "Number of consumers.", "n", "1");
+    QCommandLineOption destinationsOption("destinations", "Number of destinations.", "n", "1");
+    QCommandLineOption rateOption(QStringList() << "r" << "rate", "Messages per second per producer, 0 for unlimited.", "rate", "0");
+    QCommandLineOption sizeOption(QStringList() << "s" << "size", "Body size: <n>, <min>-<max> or <a>,<b>,...", "bytes", "1024");
+    QCommandLineOption ackOption("ack", "Ack mode: auto, client or client-individual.", "mode", "auto");
+    QCommandLineOption txOption("tx-size", "Messages per transaction, 0 for none.", "n", "0");
+    QCommandLineOption receiptsOption("receipts", "Ask for a receipt on every message.");
+    QCommandLineOption pendingOption("max-pending", "Receipts outstanding per producer, 0 for no limit.", "n", "0");
+    QCommandLineOption durationOption(QStringList() << "z" << "duration", "Run time in seconds.", "seconds", "10");
+    QCommandLineOption messagesOption(QStringList() << "C" << "messages", "Messages per producer, overrides the duration.", "n", "0");
+    QCommandLineOption jsonOption("json", "Print the summary as JSON only.");
+    parser.addOptions({hostOption, portOption, mockOption, producersOption, consumersOption, destinationsOption,
+                       rateOption, sizeOption, ackOption, txOption, receiptsOption, pendingOption,
+                       durationOption, messagesOption, jsonOption});
+    parser.process(app);
+
+    QStompPerfOptions options;
+    options.host = parser.value(hostOption);
+    options.port = quint16(parser.value(portOption).toUInt());
+    options.mock = parser.isSet(mockOption);
+    options.producers = qMax(0, parser.value(producersOption).toInt());
+    options.consumers = qMax(0, parser.value(consumersOption).toInt());
+    options.destinations = qMax(1, parser.value(destinationsOption).toInt());
+    options.rate = qMax(0.0, parser.value(rateOption).toDouble());
+    options.ack = parser.value(ackOption);
+    options.transactionSize = qMax(0, parser.value(txOption).toInt());
+    options.receipts = parser.isSet(receiptsOption);
+    options.maxPendingReceipts = qMax(0, parser.value(pendingOption).toInt());
+    options.duration = qMax(1, parser.value(durationOption).toInt());
+    options.messages = qMax<qint64>(0, parser.value(messagesOption).toLongLong());
+    options.json = parser.isSet(jsonOption);
+    if(!parseSizes(parser.value(sizeOption), &options)){
+        qCritical() << "Invalid size:" << parser.value(sizeOption);
+        return 1;
+    }
+    if(!Stomp::AckTypeList.contains(options.ack)){
+        qCritical() << "Invalid ack mode:" << options.ack;
+        return 1;
+    }
+
+    QLoggingCategory::setFilterRules("*.debug=false");
+    QStompPerf perf(options);
+    QObject::connect(&perf, &QStompPerf::finished, &app, &QCoreApplication::exit);
+    if(!perf.start())
+        return 1;
+    return app.exec();
+}
@@ -0,0 +1,317 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "perf.h"
+#include "mockbroker.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QTextStream>
+#include <QtCore/QDebug>
+#include <QtNetwork/QTcpSocket>
+#include <algorithm>
+#include <chrono>
+
+static const QString PerfSentHeader("x-perf-sent");
+static const qint64 MaxQueuedBytes = 8*1024*1024;
+
+static qint64 monotonicNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static QString destinationOf(int index, const QStompPerfOptions &options)
+{
+    return QString("/topic/qstomp-perf-%1").arg(index % qMax(1, options.destinations));
+}
+
+QStompPerfOptions::QStompPerfOptions() : host("127.0.0.1"), port(61613), mock(false), producers(1), consumers(1),
+    destinations(1), rate(0), sizes({1024}), sizeRange(false), ack("auto"), transactionSize(0), receipts(false),
+    maxPendingReceipts(0), duration(10), messages(0), json(false)
+{
+}
+
+
+QStompPerfProducer::QStompPerfProducer(int index, const QStompPerfOptions &options, QObject *parent) : QObject(parent),
+    m_sent(0), m_confirmed(0), m_finished(false), m_options(options), m_destination(destinationOf(index, options)),
+    m_inTransaction(0), m_transactions(0), m_random(quint32(index + 1))
+{
+    this->setObjectName(QString("producer-%1").arg(index));
+    this->m_payload = QByteArray(*std::max_element(options.sizes.constBegin(), options.sizes.constEnd()), 'x');
+    this->m_client.setMaxPendingReceipts(options.maxPendingReceipts);
+    connect(&this->m_client, &QStompClient::frameReceiptReceived, this, [this]() { this->m_confirmed++; });
+    // without a rate, send a burst every time the event loop comes around
+    this->m_timer.setInterval(options.rate > 0 ? 1 : 0);
+    connect(&this->m_timer, SIGNAL(timeout()), this, SLOT(onTick()));
+}
+
+void QStompPerfProducer::start()
+{
+    this->m_clock.start();
+    this->m_timer.start();
+}
+
+void QStompPerfProducer::stop()
+{
+    this->m_timer.stop();
+    if(this->m_inTransaction > 0){
+        this->m_client.commit(this->m_transaction);
+        this->m_inTransaction = 0;
+    }
+    this->m_finished = true;
+}
+
+void QStompPerfProducer::onTick()
+{
+    QTcpSocket *socket = this->m_client.socket();
+    if(this->m_finished || !socket || socket->bytesToWrite() > MaxQueuedBytes)
+        return;
+    qint64 target = this->m_options.rate > 0 ? qint64(this->m_options.rate * this->m_clock.nsecsElapsed() / 1e9) : this->m_sent + 256;
+    if(this->m_options.messages > 0)
+        target = qMin(target, this->m_options.messages);
+    while(this->m_sent < target)
+        this->sendOne();
+    if(this->m_options.messages > 0 && this->m_sent >= this->m_options.messages)
+        this->stop();
+}
+
+int QStompPerfProducer::nextSize()
+{
+    const QVector<int> &sizes = this->m_options.sizes;
+    if(this->m_options.sizeRange)
+        return int(this->m_random.bounded(sizes.first(), sizes.last() + 1));
+    return sizes.at(int(this->m_random.bounded(sizes.size())));
+}
+
+void QStompPerfProducer::sendOne()
+{
+    if(this->m_options.transactionSize > 0 && this->m_inTransaction == 0){
+        this->m_transaction = QString("%1-tx-%2").arg(this->objectName()).arg(++this->m_transactions);
+        this->m_client.begin(this->m_transaction);
+    }
+
+    QVariantMap headers;
+    headers.insert(PerfSentHeader, monotonicNs());
+    QString body = QString::fromLatin1(this->m_payload.constData(), this->nextSize());
+    QString transaction = this->m_options.transactionSize > 0 ? this->m_transaction : QString();
+    if(this->m_options.receipts)
+        this->m_client.sendWithReceipt(this->m_destination, body, transaction, headers);
+    else
+        this->m_client.send(this->m_destination, body, transaction, headers);
+    this->m_sent++;
+
+    if(this->m_options.transactionSize > 0 && ++this->m_inTransaction >= this->m_options.transactionSize){
+        this->m_client.commit(this->m_transaction);
+        this->m_inTransaction = 0;
+    }
+}
+
+
+QStompPerfConsumer::QStompPerfConsumer(int index, const QStompPerfOptions &options, QObject *parent) : QObject(parent),
+    m_received(0), m_bytes(0), m_options(options), m_destination(destinationOf(index, options))
+{
+}
+
+void QStompPerfConsumer::subscribe()
+{
+    QStompSubscription sub = this->m_client.createSubscription(this, "onMessage(QStompResponseFrame)", this->m_destination, this->m_options.ack);
+    this->m_client.registerSubscription(sub);
+}
+
+void QStompPerfConsumer::onMessage(QStompResponseFrame frame)
+{
+    this->m_received++;
+    this->m_bytes += frame.rawBody().size();
+    if(frame.headerHasKey(PerfSentHeader))
+        this->m_latencies.record(monotonicNs() - frame.headerValue(PerfSentHeader).toLongLong());
+    if(this->m_options.ack != "auto")
+        this->m_client.ack(frame.messageId());
+}
+
+
+QStompPerf::QStompPerf(const QStompPerfOptions &options, QObject *parent) : QObject(parent),
+    m_options(options), m_broker(nullptr), m_lastSent(0), m_lastReceived(0), m_lastReport(0), m_stopping(false)
+{
+    connect(&this->m_reportTimer, SIGNAL(timeout()), this, SLOT(onReport()));
+}
+
+QStompPerf::~QStompPerf()
+{
+    qDeleteAll(this->m_producers);
+    qDeleteAll(this->m_consumers);
+}
+
+bool QStompPerf::waitConnected(QStompClient *client)
+{
+    bool connected = false;
+    QMetaObject::Connection c = connect(client, &QStompClient::frameConnectedReceived, [&connected]() { connected = true; });
+    client->connectToHost(this->m_options.host, this->m_options.port);
+    QElapsedTimer timer;
+    timer.start();
+    while(!connected && timer.elapsed() < 10000)
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 50);
+    disconnect(c);
+    if(!connected)
+        qCritical() << "Cannot connect to" << this->m_options.host << this->m_options.port;
+    return connected;
+}
+
+bool QStompPerf::start()
+{
+    if(this->m_options.mock){
+        this->m_broker = new QStompMockBroker(this);
+        if(!this->m_broker->listen(QHostAddress::LocalHost, 0)){
+            qCritical() << "Mock broker cannot listen:" << this->m_broker->errorString();
+            return false;
+        }
+        this->m_options.host = "127.0.0.1";
+        this->m_options.port = this->m_broker->serverPort();
+    }
+
+    for(int i = 0; i < this->m_options.consumers; i++){
+        QStompPerfConsumer *consumer = new QStompPerfConsumer(i, this->m_options);
+        this->m_consumers << consumer;
+        if(!this->waitConnected(&consumer->m_client))
+            return false;
+        consumer->subscribe();
+        // SUBSCRIBE went out before this, so its receipt means the broker has it
+        QFuture<QStompResponseFrame> receipt = consumer->m_client.sendWithReceipt("/topic/qstomp-perf-settle", QString());
+        while(!receipt.isFinished())
+            QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 50);
+    }
+    for(int i = 0; i < this->m_options.producers; i++){
+        QStompPerfProducer *producer = new QStompPerfProducer(i, this->m_options);
+        this->m_producers << producer;
+        if(!this->waitConnected(&producer->m_client))
+            return false;
+    }
+
+    this->m_clock.start();
+    for(QStompPerfProducer *producer : this->m_producers)
+        producer->start();
+    this->m_reportTimer.start(1000);
+    if(this->m_options.messages == 0)
+        QTimer::singleShot(this->m_options.duration * 1000, this, SLOT(onStop()));
+    return true;
+}
+
+void QStompPerf::onReport()
+{
+    qint64 sent = 0, received = 0;
+    bool producing = false;
+    for(QStompPerfProducer *producer : this->m_producers){
+        sent += producer->m_sent;
+        producing |= !producer->m_finished;
+    }
+    for(QStompPerfConsumer *consumer : this->m_consumers)
+        received += consumer->m_received;
+
+    qint64 now = this->m_clock.elapsed();
+    double seconds = qMax<qint64>(1, now - this->m_lastReport) / 1000.0;
+    if(!this->m_options.json)
+        QTextStream(stdout) << QString("time %1s, sent %2 msg/s, received %3 msg/s")
+                               .arg(now / 1000.0, 0, 'f', 1)
+                               .arg(qint64((sent - this->m_lastSent) / seconds))
+                               .arg(qint64((received - this->m_lastReceived) / seconds)) << endl;
+    this->m_lastSent = sent;
+    this->m_lastReceived = received;
+    this->m_lastReport = now;
+
+    if(!producing && !this->m_stopping)
+        this->onStop();
+}
+
+void QStompPerf::onStop()
+{
+    if(this->m_stopping)
+        return;
+    this->m_stopping = true;
+    for(QStompPerfProducer *producer : this->m_producers)
+        producer->stop();
+    qint64 sendTime = this->m_clock.elapsed();
+
+    // every consumer gets what the producers sent to its destination
+    qint64 expected = 0;
+    for(int c = 0; c < this->m_consumers.size(); c++){
+        for(int p = 0; p < this->m_producers.size(); p++){
+            if(c % qMax(1, this->m_options.destinations) == p % qMax(1, this->m_options.destinations))
+                expected += this->m_producers.at(p)->m_sent;
+        }
+    }
+    QElapsedTimer drain;
+    drain.start();
+    forever {
+        qint64 received = 0;
+        for(QStompPerfConsumer *consumer : this->m_consumers)
+            received += consumer->m_received;
+        if(received >= expected || drain.elapsed() > 5000)
+            break;
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 50);
+    }
+    this->m_reportTimer.stop();
+
+    qint64 sent = 0, confirmed = 0, received = 0, bytes = 0;
+    QStompHistogram latencies;
+    for(QStompPerfProducer *producer : this->m_producers){
+        sent += producer->m_sent;
+        confirmed += producer->m_confirmed;
+    }
+    for(QStompPerfConsumer *consumer : this->m_consumers){
+        received += consumer->m_received;
+        bytes += consumer->m_bytes;
+        latencies.merge(consumer->m_latencies);
+    }
+    auto percentile = [&latencies](double p) {
+        return latencies.percentile(p) / 1e6;
+    };
+    double sendSeconds = qMax<qint64>(1, sendTime) / 1000.0;
+    double totalSeconds = qMax<qint64>(1, this->m_clock.elapsed()) / 1000.0;
+
+    QJsonObject summary{
+        {"producers", this->m_options.producers},
+        {"consumers", this->m_options.consumers},
+        {"destinations", this->m_options.destinations},
+        {"ack", this->m_options.ack},
+        {"transaction_size", this->m_options.transactionSize},
+        {"receipts", this->m_options.receipts},
+        {"sent", sent},
+        {"received", received},
+        {"expected", expected},
+        {"confirmed", confirmed},
+        {"send_rate", sent / sendSeconds},
+        {"receive_rate", received / totalSeconds},
+        {"receive_mb_per_sec", bytes / totalSeconds / 1e6},
+        {"latency_p50_ms", percentile(0.5)},
+        {"latency_p99_ms", percentile(0.99)},
+        {"latency_p999_ms", percentile(0.999)},
+        {"latency_max_ms", latencies.max() / 1e6}
+    };
+    QTextStream out(stdout);
+    if(this->m_options.json){
+        out << QJsonDocument(summary).toJson();
+    }else{
+        for(auto it = summary.constBegin(); it != summary.constEnd(); ++it)
+            out << it.key() << ": " << it.value().toVariant().toString() << endl;
+    }
+    out.flush();
+    emit finished(received >= expected ? 0 : 2);
+}
@@ -0,0 +1,138 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QSTOMPPERF_H
+#define QSTOMPPERF_H
+
+#include <qstomp.h>
+
+#include <QtCore/QObject>
+#include <QtCore/QTimer>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QVector>
+#include <QtCore/QRandomGenerator>
+
+class QStompMockBroker;
+
+class QStompPerfOptions
+{
+public:
+    QStompPerfOptions();
+
+    QString host;
+    quint16 port;
+    bool mock;
+    int producers;
+    int consumers;
+    int destinations;
+    double rate; // messages per second and producer, 0 is unlimited
+    QVector<int> sizes; // picked at random, or the bounds of a range
+    bool sizeRange;
+    QString ack;
+    int transactionSize; // messages per transaction, 0 sends outside transactions
+    bool receipts;
+    int maxPendingReceipts;
+    int duration; // seconds
+    qint64 messages; // per producer, 0 runs for the duration
+    bool json;
+};
+
+class QStompPerfProducer : public QObject
+{
+    Q_OBJECT
+public:
+    QStompPerfProducer(int index, const QStompPerfOptions &options, QObject *parent = nullptr);
+
+    QStompClient m_client;
+    qint64 m_sent;
+    qint64 m_confirmed;
+    bool m_finished;
+
+public slots:
+    void start();
+    void stop();
+
+private slots:
+    void onTick();
+
+private:
+    int nextSize();
+    void sendOne();
+
+    const QStompPerfOptions &m_options;
+    QString m_destination;
+    QString m_transaction;
+    int m_inTransaction;
+    int m_transactions;
+    QTimer m_timer;
+    QElapsedTimer m_clock;
+    QRandomGenerator m_random;
+    QByteArray m_payload;
+};
+
+class QStompPerfConsumer : public QObject
+{
+    Q_OBJECT
+public:
+    QStompPerfConsumer(int index, const QStompPerfOptions &options, QObject *parent = nullptr);
+    void subscribe();
+
+    QStompClient m_client;
+    qint64 m_received;
+    qint64 m_bytes;
+    QStompHistogram m_latencies; // ns
+
+public slots:
+    void onMessage(QStompResponseFrame frame);
+
+private:
+    const QStompPerfOptions &m_options;
+    QString m_destination;
+};
+
+class QStompPerf : public QObject
+{
+    Q_OBJECT
+public:
+    explicit QStompPerf(const QStompPerfOptions &options, QObject *parent = nullptr);
+    ~QStompPerf();
+    bool start();
+
+signals:
+    void finished(int exitCode);
+
+private slots:
+    void onReport();
+    void onStop();
+
+private:
+    bool waitConnected(QStompClient *client);
+
+    QStompPerfOptions m_options;
+    QStompMockBroker *m_broker;
+    QList<QStompPerfProducer*> m_producers;
+    QList<QStompPerfConsumer*> m_consumers;
+    QTimer m_reportTimer;
+    QElapsedTimer m_clock;
+    qint64 m_lastSent, m_lastReceived, m_lastReport;
+    bool m_stopping;
+};
+
+#endif // QSTOMPPERF_H
@@ -0,0 +1,158 @@
+/*
+ * This file is part of QStomp
+ *
+ * Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+ *
+ * This library is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General
+ * Public License along with this library; see the file
+ * COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <qstomp.h>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QFile>
+#include <QtCore/QThread>
+#include <QtCore/QtEndian>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QDebug>
+
+struct QStompCaptureRecord
+{
+    qint64 offset; // ns since the capture started
+    QByteArray data;
+};
+
+static bool loadCapture(const QString &fileName, QVector<QStompCaptureRecord> *records)
+{
+    QFile file(fileName);
+    if(!file.open(QIODevice::ReadOnly)){
+        qCritical() << "Cannot read" << fileName << file.errorString();
+        return false;
+    }
+    QByteArray content = file.readAll();
+    if(!content.startsWith(Stomp::CaptureMagic)){
+        qCritical() << fileName << "is not a QStomp capture";
+        return false;
+    }
+
+    int pos = Stomp::CaptureMagic.size();
+    while(pos < content.size()){
+        if(content.size() - pos < 12){
+            qWarning() << "Ignoring truncated record at offset" << pos;
+            break;
+        }
+        QStompCaptureRecord record;
+        record.offset = qint64(qFromLittleEndian<quint64>(content.constData() + pos));
+        quint32 length = qFromLittleEndian<quint32>(content.constData() + pos + 8);
+        pos += 12;
+        if(quint32(content.size() - pos) < length){
+            qWarning() << "Ignoring truncated record at offset" << pos - 12;
+            break;
+        }
+        record.data = content.mid(pos, int(length));
+        pos += int(length);
+        records->append(record);
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("qstomp-replay");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Replays a QStomp wire capture through the client's decoder");
+    parser.addHelpOption();
+    parser.addPositionalArgument("capture", "Capture file written by QStompClient::setCaptureFile().");
+    QCommandLineOption pacedOption("paced", "Keep the original timing between reads instead of replaying as fast as possible.");
+    QCommandLineOption repeatOption(QStringList() << "n" << "repeat", "Replay the capture <n> times.", "n", "1");
+    QCommandLineOption jsonOption("json", "Print the summary as JSON only.");
+    parser.addOptions({pacedOption, repeatOption, jsonOption});
+    parser.process(app);
+
+    if(parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+    QVector<QStompCaptureRecord> records;
+    if(!loadCapture(parser.positionalArguments().first(), &records))
+        return 1;
+    bool paced = parser.isSet(pacedOption);
+    int repeat = qMax(1, parser.value(repeatOption).toInt());
+
+    // keep the library's own logging out of the measurements
+    QLoggingCategory::setFilterRules("*.debug=false");
+    QStompClient client;
+
+    quint64 bytes = 0;
+    QElapsedTimer clock;
+    clock.start();
+    for(int round = 0; round < repeat; round++){
+        qint64 roundStart = clock.nsecsElapsed();
+        for(int i = 0; i < records.size(); i++){
+            const QStompCaptureRecord &record = records.at(i);
+            if(paced){
+                qint64 due = roundStart + record.offset;
+                while(clock.nsecsElapsed() < due){
+                    app.processEvents();
+                    qint64 wait = (due - clock.nsecsElapsed()) / 1000;
+                    if(wait > 100)
+                        QThread::usleep(quint64(qMin<qint64>(wait - 50, 1000)));
+                }
+            }
+            client.injectReceivedData(record.data);
+            bytes += quint64(record.data.size());
+            // let queued slot invocations run so they do not pile up
+            if(paced || i % 1000 == 999)
+                app.processEvents();
+        }
+    }
+    app.processEvents();
+    double seconds = qMax<qint64>(1, clock.nsecsElapsed()) / 1e9;
+
+    QStompClientStatistics stats = client.statistics();
+    QJsonObject summary {
+        {"records", records.size() * repeat},
+        {"bytes", double(bytes)},
+        {"frames", double(stats.framesReceived)},
+        {"parse_errors", double(stats.parseErrors)},
+        {"resyncs", double(stats.resyncs)},
+        {"seconds", seconds},
+        {"mb_per_second", bytes / seconds / (1024.0 * 1024.0)},
+        {"frames_per_second", stats.framesReceived / seconds},
+        {"parse_p50_ns", double(stats.parseTime.percentile(0.5))},
+        {"parse_p99_ns", double(stats.parseTime.percentile(0.99))},
+        {"paced", paced}
+    };
+
+    QFile out;
+    out.open(stdout, QIODevice::WriteOnly);
+    if(parser.isSet(jsonOption)){
+        out.write(QJsonDocument(summary).toJson());
+        return 0;
+    }
+    out.write(QString("%1 records, %2 bytes, %3 frames in %4 s\n")
+              .arg(summary["records"].toInt()).arg(bytes).arg(stats.framesReceived).arg(seconds, 0, 'f', 3).toUtf8());
+    out.write(QString("%1 MB/s, %2 frames/s, parse p50 %3 us, p99 %4 us\n")
+              .arg(summary["mb_per_second"].toDouble(), 0, 'f', 1)
+              .arg(summary["frames_per_second"].toDouble(), 0, 'f', 0)
+              .arg(stats.parseTime.percentile(0.5) / 1000.0, 0, 'f', 2)
+              .arg(stats.parseTime.percentile(0.99) / 1000.0, 0, 'f', 2).toUtf8());
+    if(stats.parseErrors || stats.resyncs)
+        out.write(QString("%1 parse errors, %2 resyncs\n").arg(stats.parseErrors).arg(stats.resyncs).toUtf8());
+    return 0;
+}
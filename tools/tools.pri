@@ -0,0 +1,36 @@
+#
+# This file is part of QStomp
+#
+# Copyright (C) 2009 Patrick Schneider <patrick.p2k.schneider@googlemail.com>
+#
+# This library is free software: you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation, either
+# version 3 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General
+# Public License along with this library; see the file
+# COPYING.LESSER.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+QT += network
+QT -= gui
+TEMPLATE = app
+CONFIG *= c++14 console
+CONFIG -= app_bundle
+DEFINES *= QT_MESSAGELOGCONTEXT
+INCLUDEPATH += $$PWD/../src
+DEPENDPATH += $$PWD/../src
+
+# QSTOMP_LIBDIR points to where QStomp.pro was built, the source root by default
+isEmpty(QSTOMP_LIBDIR): QSTOMP_LIBDIR = $$OUT_PWD/../..
+CONFIG(debug, debug|release) {
+    LIBS += -L$$QSTOMP_LIBDIR -lqstompd
+} else {
+    LIBS += -L$$QSTOMP_LIBDIR -lqstomp
+}